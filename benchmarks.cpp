@@ -0,0 +1,300 @@
+// MIT No Attribution
+
+// Copyright 2024 Dr Seb N.F. Sikora
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this
+// software and associated documentation files (the "Software"), to deal in the Software
+// without restriction, including without limitation the rights to use, copy, modify,
+// merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+// Benchmarks to measure the overhead of cpp-tp.hpp itself, using jobs that do (almost) nothing
+
+
+// to compile, link against libpthread, eg:
+// $ g++ -std=c++14 -O2 benchmarks.cpp -o benchmarks -lpthread
+//
+// Results are written to stdout as CSV, one row per measurement, eg:
+// $ ./benchmarks > results.csv
+// $ ./benchmarks --quick --max-workers 8
+//
+// Options:
+//   --quick              run fewer jobs, for a fast sanity check
+//   --max-workers N      scale worker count up to N (default hardware_concurrency())
+//   --producer-factor M  the largest producer count is max workers x M (default 4)
+//
+// Every benchmark is run for each pool configuration listed in main(), for worker counts 1, 2, 4 ... max workers
+// and for 1, N (= worker count) and N x M producer threads, so that scheduler modes and queue backends can be
+// compared on the same numbers.
+
+
+# include "cpp-tp.hpp"
+
+
+#include <vector>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+
+using Clock = std::chrono::steady_clock;
+
+
+struct Options {
+    bool quick = false;
+    size_t max_workers = 0;
+    size_t producer_factor = 4;
+};
+
+
+// One row of output
+struct Result {
+    std::string benchmark;
+    std::string pool;
+    size_t workers = 0;
+    size_t producers = 0;
+    size_t jobs = 0;
+    double seconds = 0.0;
+    std::vector<double> latencies_us;   // if the benchmark measures per-job latency
+};
+
+
+void printHeader() {
+    std::cout << "benchmark,pool,workers,producers,jobs,seconds,jobs_per_sec,mean_us,p50_us,p90_us,p99_us,p999_us,max_us" << std::endl;
+}
+
+
+double percentile(const std::vector<double>& sorted, double fraction) {
+    size_t index = static_cast<size_t>(fraction * static_cast<double>(sorted.size() - 1));
+    return sorted[index];
+}
+
+
+void printResult(Result& result) {
+    std::ostringstream row;
+    row << result.benchmark << "," << result.pool << "," << result.workers << "," << result.producers << ","
+        << result.jobs << "," << result.seconds << "," << (static_cast<double>(result.jobs) / result.seconds);
+
+    if (result.latencies_us.empty()) {
+        row << ",,,,,,";
+    } else {
+        std::vector<double>& samples = result.latencies_us;
+        std::sort(samples.begin(), samples.end());
+        double sum = 0.0;
+        for (double sample : samples) {
+            sum += sample;
+        }
+        row << "," << (sum / static_cast<double>(samples.size())) << "," << percentile(samples, 0.5) << ","
+            << percentile(samples, 0.9) << "," << percentile(samples, 0.99) << "," << percentile(samples, 0.999) << ","
+            << samples.back();
+    }
+    std::cout << row.str() << std::endl;
+}
+
+
+double microsecondsBetween(Clock::time_point from, Clock::time_point to) {
+    return std::chrono::duration<double, std::micro>(to - from).count();
+}
+
+
+// Run producer(p) on each of producer_count threads, all released at the same moment
+template<typename Producer>
+void runProducers(size_t producer_count, Producer producer) {
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (size_t p = 0; p < producer_count; ++p) {
+        threads.emplace_back([&go, &producer, p](){
+            while (!go) {
+                std::this_thread::yield();
+            }
+            producer(p);
+        });
+    }
+    go = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+
+// Empty jobs per second, from submission of the first job until wait() returns after the last
+template<typename Pool>
+Result benchThroughput(Pool& pool, size_t producer_count, size_t job_count) {
+    Result result;
+    result.benchmark = "throughput";
+    size_t jobs_per_producer = job_count / producer_count;
+    result.jobs = jobs_per_producer * producer_count;
+
+    Clock::time_point start = Clock::now();
+    runProducers(producer_count, [&pool, jobs_per_producer](size_t){
+        for (size_t i = 0; i < jobs_per_producer; ++i) {
+            pool.addJob([](){});
+        }
+    });
+    pool.wait();
+    result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    return result;
+}
+
+
+// Time from addJob() until the job starts running, with submissions spaced out so that the pool is mostly idle
+// and the latency includes waking a worker
+template<typename Pool>
+Result benchLatency(Pool& pool, size_t producer_count, size_t samples_per_producer) {
+    Result result;
+    result.benchmark = "submit_to_start_latency";
+    result.jobs = samples_per_producer * producer_count;
+    std::vector<double> latencies(result.jobs);
+    const auto gap = std::chrono::microseconds(50);
+
+    Clock::time_point start = Clock::now();
+    runProducers(producer_count, [&pool, &latencies, samples_per_producer, gap](size_t p){
+        for (size_t i = 0; i < samples_per_producer; ++i) {
+            double* sample = &latencies[(p * samples_per_producer) + i];
+            Clock::time_point submitted = Clock::now();
+            pool.addJob([sample, submitted](){ *sample = microsecondsBetween(submitted, Clock::now()); });
+            while (Clock::now() < submitted + gap) {
+                std::this_thread::yield();
+            }
+        }
+    });
+    pool.wait();
+    result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    result.latencies_us = std::move(latencies);
+    return result;
+}
+
+
+// Cost of adding a single job and wait()ing for it, one producer only
+template<typename Pool>
+Result benchWaitRoundTrip(Pool& pool, size_t round_trips) {
+    Result result;
+    result.benchmark = "wait_round_trip";
+    result.producers = 1;
+    result.jobs = round_trips;
+    result.latencies_us.reserve(round_trips);
+
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < round_trips; ++i) {
+        Clock::time_point submitted = Clock::now();
+        pool.addJob([](){});
+        pool.wait();
+        result.latencies_us.push_back(microsecondsBetween(submitted, Clock::now()));
+    }
+    result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    return result;
+}
+
+
+// Cost of submit()ing a job with a result and get()ting it, one producer only
+template<typename Pool>
+Result benchSubmitRoundTrip(Pool& pool, size_t round_trips) {
+    Result result;
+    result.benchmark = "submit_get_round_trip";
+    result.producers = 1;
+    result.jobs = round_trips;
+    result.latencies_us.reserve(round_trips);
+
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < round_trips; ++i) {
+        Clock::time_point submitted = Clock::now();
+        pool.submit([i](){ return i; }).get();
+        result.latencies_us.push_back(microsecondsBetween(submitted, Clock::now()));
+    }
+    result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    return result;
+}
+
+
+// Run every benchmark against one pool configuration
+template<typename Pool>
+void runSuite(const std::string& name, bool work_stealing, const Options& options) {
+    size_t job_count = options.quick ? 20000 : 1000000;
+    size_t latency_samples = options.quick ? 200 : 5000;
+    size_t round_trips = options.quick ? 200 : 10000;
+
+    std::vector<size_t> worker_counts;
+    for (size_t workers = 1; workers < options.max_workers; workers *= 2) {
+        worker_counts.push_back(workers);
+    }
+    worker_counts.push_back(options.max_workers);
+
+    for (size_t workers : worker_counts) {
+        Pool pool(true, workers, work_stealing);
+
+        std::vector<size_t> producer_counts = {1, workers, workers * options.producer_factor};
+        producer_counts.erase(std::unique(producer_counts.begin(), producer_counts.end()), producer_counts.end());
+
+        for (size_t producers : producer_counts) {
+            Result throughput = benchThroughput(pool, producers, job_count);
+            Result latency = benchLatency(pool, producers, latency_samples / producers + 1);
+            for (Result* result : {&throughput, &latency}) {
+                result->pool = name;
+                result->workers = workers;
+                result->producers = producers;
+                printResult(*result);
+            }
+        }
+
+        Result wait_round_trip = benchWaitRoundTrip(pool, round_trips);
+        Result submit_round_trip = benchSubmitRoundTrip(pool, round_trips);
+        for (Result* result : {&wait_round_trip, &submit_round_trip}) {
+            result->pool = name;
+            result->workers = workers;
+            printResult(*result);
+        }
+    }
+}
+
+
+int main(int argc, char** argv) {
+
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--quick") == 0) {
+            options.quick = true;
+        } else if ((std::strcmp(argv[i], "--max-workers") == 0) && (i + 1 < argc)) {
+            options.max_workers = std::strtoul(argv[++i], nullptr, 10);
+        } else if ((std::strcmp(argv[i], "--producer-factor") == 0) && (i + 1 < argc)) {
+            options.producer_factor = std::strtoul(argv[++i], nullptr, 10);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--quick] [--max-workers N] [--producer-factor M]" << std::endl;
+            return 1;
+        }
+    }
+    if (options.max_workers == 0) {
+        options.max_workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (options.producer_factor == 0) {
+        options.producer_factor = 1;
+    }
+
+    printHeader();
+
+    // pool configurations to compare - add new scheduler modes and queue backends here
+    runSuite<ThreadPool>("unbounded_shared", false, options);
+    runSuite<ThreadPool>("unbounded_stealing", true, options);
+    runSuite<BasicThreadPool<BoundedMpmcQueue<4096>>>("mpmc4096_shared", false, options);
+    runSuite<BasicThreadPool<BoundedMpmcQueue<4096>>>("mpmc4096_stealing", true, options);
+    runSuite<BasicThreadPool<UnboundedQueue, AdaptiveIdle, NoMetrics>>("unbounded_shared_nometrics", false, options);
+
+    return 0;
+}
@@ -21,218 +21,5408 @@
 
 
 #include <functional>
-#include <queue>
 #include <memory>
 #include <vector>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <future>
+#include <exception>
+#include <tuple>
+#include <atomic>
+#include <type_traits>
+#include <utility>
+#include <cstddef>
+#include <new>
+#include <iterator>
+#include <cstdint>
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <chrono>
+#include <initializer_list>
 
 
-#ifdef VERBOSE
-#include <iostream>
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
 #endif
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#include <optional>
+#endif
+
+
+namespace tp_detail {
+
+// operator new for memory of any (power of two) alignment, which plain operator new only honours up to
+// alignof(std::max_align_t). Without C++17's aligned operator new, the block is over-allocated and aligned by hand,
+// with the pointer operator new returned kept just before it.
+inline void* alignedNew(size_t size, size_t align) {
+    if (align <= alignof(std::max_align_t)) {
+        return ::operator new(size);
+    }
+#ifdef __cpp_aligned_new
+    return ::operator new(size, std::align_val_t(align));
+#else
+    void* raw = ::operator new(size + align - 1 + sizeof(void*));
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + sizeof(void*) + align - 1) & ~(static_cast<uintptr_t>(align) - 1);
+    reinterpret_cast<void**>(aligned)[-1] = raw;
+    return reinterpret_cast<void*>(aligned);
+#endif
+}
 
-class ThreadPool {
+
+// Free memory from alignedNew(), with the same alignment
+inline void alignedDelete(void* ptr, size_t align) noexcept {
+    if (align <= alignof(std::max_align_t)) {
+        ::operator delete(ptr);
+        return;
+    }
+#ifdef __cpp_aligned_new
+    ::operator delete(ptr, std::align_val_t(align));
+#else
+    ::operator delete(reinterpret_cast<void**>(ptr)[-1]);
+#endif
+}
+
+
+// A recycling block allocator for the callables of Jobs that are too large to be stored inline. Each thread
+// keeps its own free list per size class, so that a worker freeing the jobs it has run and a producer allocating
+// new ones don't meet in malloc. Blocks move between threads in batches of BATCH_SIZE through a shared list per
+// size class, which is the only place a lock is taken, once per batch. A thread that exits hands all of its blocks
+// back, the last of them as a short batch, so that threads coming and going don't strand blocks. Blocks are never
+// given back to the system.
+// Larger or over-aligned requests fall through to alignedNew().
+class JobBlocks {
 public:
 
-    // Constructor
-    ThreadPool(bool auto_start, size_t worker_count = 0) :  // If worker_count == 0, = number of hardware threads
-        m_stopped(true),
-        m_waiting(false),
-        m_pending_jobs(0)
-    {
-        if (auto_start) {
-            start(worker_count);
+    static constexpr size_t BLOCK_SIZE = 64;
+    static constexpr size_t CLASS_COUNT = 8;        // so blocks of up to 512 bytes are recycled
+    static constexpr size_t BATCH_SIZE = 32;
+
+
+    static void* allocate(size_t size, size_t align) {
+        if ((size > BLOCK_SIZE * CLASS_COUNT) || (align > alignof(std::max_align_t))) {
+            return alignedNew(size, align);
+        }
+
+        size_t size_class = sizeClass(size);
+        FreeList& local = localCache().lists[size_class];
+        if (local.head == nullptr) {
+            shared().takeBatch(size_class, local);
+        }
+        FreeBlock* block = local.head;
+        local.head = block->next;
+        --local.count;
+        return block;
+    }
+
+
+    static void deallocate(void* ptr, size_t size, size_t align) noexcept {
+        if ((size > BLOCK_SIZE * CLASS_COUNT) || (align > alignof(std::max_align_t))) {
+            alignedDelete(ptr, align);
+            return;
+        }
+
+        size_t size_class = sizeClass(size);
+        FreeList& local = localCache().lists[size_class];
+        local.head = ::new (ptr) FreeBlock{local.head, nullptr, 0};
+        if (++local.count >= 2 * BATCH_SIZE) {
+            shared().giveBatch(size_class, local, BATCH_SIZE);  // keep a batch in hand for our own next allocations
+        }
+    }
+
+private:
+
+    struct FreeBlock {
+        FreeBlock* next;
+        FreeBlock* next_batch;  // in the shared list, the first block of the next batch
+        size_t batch_count;     // in the shared list, the number of blocks in this batch
+    };
+
+    struct FreeList {
+        FreeBlock* head = nullptr;
+        size_t count = 0;
+    };
+
+
+    // The shared lists, which hold whole batches apart from those handed back by exiting threads
+    class SharedLists {
+    public:
+
+        void takeBatch(size_t size_class, FreeList& local) {
+            {
+                std::lock_guard<std::mutex> b_lk(m_mutex);
+                FreeBlock*& batches = m_batches[size_class];
+                if (batches != nullptr) {
+                    local.head = batches;
+                    local.count = batches->batch_count;
+                    batches = batches->next_batch;
+                    return;
+                }
+            }
+
+            size_t block_size = (size_class + 1) * BLOCK_SIZE;
+            unsigned char* chunk = static_cast<unsigned char*>(::operator new(block_size * BATCH_SIZE));
+            for (size_t i = 0; i < BATCH_SIZE; ++i) {
+                local.head = ::new (chunk + (i * block_size)) FreeBlock{local.head, nullptr, 0};
+            }
+            local.count = BATCH_SIZE;
+        }
+
+
+        // Move the first count (> 0) blocks of a thread's free list onto the shared list as a batch
+        void giveBatch(size_t size_class, FreeList& local, size_t count) noexcept {
+            FreeBlock* first = local.head;
+            FreeBlock* last = first;
+            for (size_t i = 1; i < count; ++i) {
+                last = last->next;
+            }
+            local.head = last->next;
+            local.count -= count;
+            last->next = nullptr;
+            first->batch_count = count;
+
+            std::lock_guard<std::mutex> b_lk(m_mutex);
+            first->next_batch = m_batches[size_class];
+            m_batches[size_class] = first;
+        }
+
+    private:
+
+        std::mutex m_mutex;
+        FreeBlock* m_batches[CLASS_COUNT] = {};
+    };
+
+
+    // A thread's free lists, handed back to the shared lists when the thread exits
+    struct LocalCache {
+        FreeList lists[CLASS_COUNT];
+
+        ~LocalCache() {
+            for (size_t size_class = 0; size_class < CLASS_COUNT; ++size_class) {
+                FreeList& list = lists[size_class];
+                while (list.count > 0) {
+                    shared().giveBatch(size_class, list, (list.count < BATCH_SIZE) ? list.count : BATCH_SIZE);
+                }
+            }
+        }
+    };
+
+
+    static size_t sizeClass(size_t size) {
+        return (size == 0) ? 0 : ((size - 1) / BLOCK_SIZE);
+    }
+
+
+    // Never destroyed, as threads may still be exiting after static destructors have run
+    static SharedLists& shared() {
+        static SharedLists* lists = new SharedLists();
+        return *lists;
+    }
+
+
+    static LocalCache& localCache() {
+        static thread_local LocalCache cache;
+        return cache;
+    }
+};
+
+}   // namespace tp_detail
+
+
+// A move-only void() callable. Callables that fit in INLINE_SIZE bytes (and can be moved without throwing)
+// are stored inside the Job itself, anything larger is moved into a block from tp_detail::JobBlocks.
+class Job {
+public:
+
+    static constexpr size_t INLINE_SIZE = 48;
+
+
+    Job() noexcept : m_ops(nullptr), m_queued_at(0) { }
+
+
+    template<typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Job>::value>::type>
+    Job(F&& work_func) : m_queued_at(0) {
+        using Callable = typename std::decay<F>::type;
+        construct<Callable>(std::forward<F>(work_func), std::integral_constant<bool, fitsInline<Callable>()>());
+    }
+
+
+    Job(Job&& other) noexcept : m_ops(other.m_ops), m_queued_at(other.m_queued_at) {
+#ifdef CPP_TP_TRACE
+        m_trace_id = other.m_trace_id;
+#endif
+        if (m_ops != nullptr) {
+            m_ops->move(m_storage, other.m_storage);
+            other.m_ops = nullptr;
+        }
+    }
+
+
+    Job& operator=(Job&& other) noexcept {
+        if (this != &other) {
+            reset();
+            if (other.m_ops != nullptr) {
+                other.m_ops->move(m_storage, other.m_storage);
+                m_ops = other.m_ops;
+                other.m_ops = nullptr;
+            }
+            m_queued_at = other.m_queued_at;
+#ifdef CPP_TP_TRACE
+            m_trace_id = other.m_trace_id;
+#endif
+        }
+        return *this;
+    }
+
+
+    Job(const Job&) = delete;
+    Job& operator=(const Job&) = delete;
+
+
+    ~Job() {
+        reset();
+    }
+
+
+    // Destroy the stored callable, leaving the Job empty
+    void reset() noexcept {
+        if (m_ops != nullptr) {
+            m_ops->destroy(m_storage);
+            m_ops = nullptr;
+        }
+    }
+
+
+    explicit operator bool() const noexcept {
+        return (m_ops != nullptr);
+    }
+
+
+    void operator()() {
+        m_ops->invoke(m_storage);
+    }
+
+
+    // When the job was queued, as a tp_detail::nowNanoseconds() time, for the thread pool's queue wait metrics
+    uint64_t queuedAt() const noexcept {
+        return m_queued_at;
+    }
+
+
+    void setQueuedAt(uint64_t queued_at) noexcept {
+        m_queued_at = queued_at;
+    }
+
+
+    // Id linking the job's events in a JobTrace, only stored when CPP_TP_TRACE is defined
+#ifdef CPP_TP_TRACE
+    uint64_t traceId() const noexcept {
+        return m_trace_id;
+    }
+
+
+    void setTraceId(uint64_t trace_id) noexcept {
+        m_trace_id = trace_id;
+    }
+#else
+    uint64_t traceId() const noexcept {
+        return 0;
+    }
+
+
+    void setTraceId(uint64_t) noexcept { }
+#endif
+
+private:
+
+    // Type-erased operations on the stored callable. move() leaves src destroyed.
+    struct Ops {
+        void (*invoke)(void*);
+        void (*move)(void* dst, void* src) noexcept;
+        void (*destroy)(void*) noexcept;
+    };
+
+    template<typename Callable>
+    static constexpr bool fitsInline() {
+        return ((sizeof(Callable) <= INLINE_SIZE) && (alignof(std::max_align_t) % alignof(Callable) == 0) &&
+                (std::is_nothrow_move_constructible<Callable>::value));
+    }
+
+
+    template<typename Callable>
+    struct InlineOps {
+        static void invoke(void* storage) {
+            (*static_cast<Callable*>(storage))();
+        }
+        static void move(void* dst, void* src) noexcept {
+            ::new (dst) Callable(std::move(*static_cast<Callable*>(src)));
+            static_cast<Callable*>(src)->~Callable();
+        }
+        static void destroy(void* storage) noexcept {
+            static_cast<Callable*>(storage)->~Callable();
+        }
+        static const Ops ops;
+    };
+
+
+    template<typename Callable>
+    struct HeapOps {
+        static void invoke(void* storage) {
+            (**static_cast<Callable**>(storage))();
+        }
+        static void move(void* dst, void* src) noexcept {
+            *static_cast<Callable**>(dst) = *static_cast<Callable**>(src);
+        }
+        static void destroy(void* storage) noexcept {
+            Callable* callable = *static_cast<Callable**>(storage);
+            callable->~Callable();
+            tp_detail::JobBlocks::deallocate(callable, sizeof(Callable), alignof(Callable));
+        }
+        static const Ops ops;
+    };
+
+
+    template<typename Callable, typename F>
+    void construct(F&& work_func, std::true_type) {
+        ::new (m_storage) Callable(std::forward<F>(work_func));
+        m_ops = &InlineOps<Callable>::ops;
+    }
+
+
+    template<typename Callable, typename F>
+    void construct(F&& work_func, std::false_type) {
+        void* block = tp_detail::JobBlocks::allocate(sizeof(Callable), alignof(Callable));
+        try {
+            *reinterpret_cast<Callable**>(m_storage) = ::new (block) Callable(std::forward<F>(work_func));
+        } catch (...) {
+            tp_detail::JobBlocks::deallocate(block, sizeof(Callable), alignof(Callable));
+            throw;
+        }
+        m_ops = &HeapOps<Callable>::ops;
+    }
+
+
+    alignas(std::max_align_t) unsigned char m_storage[INLINE_SIZE];
+    const Ops* m_ops;
+    uint64_t m_queued_at;   // fits in what would otherwise be padding
+#ifdef CPP_TP_TRACE
+    uint64_t m_trace_id = 0;
+#endif
+};
+
+template<typename Callable>
+const Job::Ops Job::InlineOps<Callable>::ops = {&Job::InlineOps<Callable>::invoke, &Job::InlineOps<Callable>::move, &Job::InlineOps<Callable>::destroy};
+
+template<typename Callable>
+const Job::Ops Job::HeapOps<Callable>::ops = {&Job::HeapOps<Callable>::invoke, &Job::HeapOps<Callable>::move, &Job::HeapOps<Callable>::destroy};
+
+
+namespace tp_detail {
+
+// A recycling block allocator for the shared states of futures returned by ThreadPool::submit(). Blocks are
+// carved from chunks in size classes of BLOCK_SIZE bytes and returned to a per-class free list when released,
+// so that after warm-up a submit() does not touch the global allocator. Larger or over-aligned requests fall
+// through to alignedNew().
+class StateSlab {
+public:
+
+    static constexpr size_t BLOCK_SIZE = 64;
+    static constexpr size_t CLASS_COUNT = 8;        // so blocks of up to 512 bytes are recycled
+    static constexpr size_t BLOCKS_PER_CHUNK = 64;
+
+
+    StateSlab() { }
+
+
+    StateSlab(const StateSlab&) = delete;
+
+
+    void* allocate(size_t size, size_t align) {
+        if ((size > BLOCK_SIZE * CLASS_COUNT) || (align > alignof(std::max_align_t))) {
+            return alignedNew(size, align);
+        }
+
+        SizeClass& size_class = m_classes[sizeClass(size)];
+        std::lock_guard<std::mutex> s_lk(size_class.mutex);
+
+        if (size_class.free_list == nullptr) {
+            size_t block_size = (sizeClass(size) + 1) * BLOCK_SIZE;
+            size_class.chunks.emplace_back(new unsigned char[block_size * BLOCKS_PER_CHUNK]);
+            unsigned char* chunk = size_class.chunks.back().get();
+            for (size_t i = 0; i < BLOCKS_PER_CHUNK; ++i) {
+                size_class.free_list = ::new (chunk + (i * block_size)) FreeBlock{size_class.free_list};
+            }
+        }
+        FreeBlock* block = size_class.free_list;
+        size_class.free_list = block->next;
+        return block;
+    }
+
+
+    void deallocate(void* ptr, size_t size, size_t align) noexcept {
+        if ((size > BLOCK_SIZE * CLASS_COUNT) || (align > alignof(std::max_align_t))) {
+            alignedDelete(ptr, align);
+            return;
+        }
+
+        SizeClass& size_class = m_classes[sizeClass(size)];
+        std::lock_guard<std::mutex> s_lk(size_class.mutex);
+        size_class.free_list = ::new (ptr) FreeBlock{size_class.free_list};
+    }
+
+private:
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct SizeClass {
+        std::mutex mutex;
+        FreeBlock* free_list = nullptr;
+        std::vector<std::unique_ptr<unsigned char[]>> chunks;
+    };
+
+
+    static size_t sizeClass(size_t size) {
+        return (size == 0) ? 0 : ((size - 1) / BLOCK_SIZE);
+    }
+
+
+    SizeClass m_classes[CLASS_COUNT];
+};
+
+
+// Standard allocator interface over a StateSlab. Every copy shares ownership of the slab, so the slab outlives
+// any shared state still held by a future after its ThreadPool has been destroyed.
+template<typename T>
+class SlabAllocator {
+public:
+
+    using value_type = T;
+
+
+    explicit SlabAllocator(std::shared_ptr<StateSlab> slab) noexcept : m_slab(std::move(slab)) { }
+
+
+    template<typename U>
+    SlabAllocator(const SlabAllocator<U>& other) noexcept : m_slab(other.m_slab) { }
+
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(m_slab->allocate(n * sizeof(T), alignof(T)));
+    }
+
+
+    void deallocate(T* ptr, size_t n) noexcept {
+        m_slab->deallocate(ptr, n * sizeof(T), alignof(T));
+    }
+
+
+    template<typename U>
+    bool operator==(const SlabAllocator<U>& other) const noexcept {
+        return (m_slab == other.m_slab);
+    }
+
+
+    template<typename U>
+    bool operator!=(const SlabAllocator<U>& other) const noexcept {
+        return (m_slab != other.m_slab);
+    }
+
+private:
+
+    template<typename U> friend class SlabAllocator;
+
+    std::shared_ptr<StateSlab> m_slab;
+};
+
+
+// The job queued by ThreadPool::submit(), which calls func(args...) and delivers the result through its promise
+template<typename R, typename F, typename... Args>
+class SubmittedJob {
+public:
+
+    template<typename G, typename... A>
+    SubmittedJob(std::promise<R>&& promise, G&& func, A&&... args) :
+        m_promise(std::move(promise)),
+        m_func(std::forward<G>(func)),
+        m_args(std::forward<A>(args)...)
+    { }
+
+
+    void operator()() {
+        try {
+            run(std::is_void<R>(), std::index_sequence_for<Args...>());
+        } catch (...) {
+            m_promise.set_exception(std::current_exception());
+        }
+    }
+
+private:
+
+    template<size_t... I>
+    void run(std::false_type, std::index_sequence<I...>) {
+        m_promise.set_value(m_func(std::move(std::get<I>(m_args))...));
+    }
+
+
+    template<size_t... I>
+    void run(std::true_type, std::index_sequence<I...>) {
+        m_func(std::move(std::get<I>(m_args))...);
+        m_promise.set_value();
+    }
+
+
+    std::promise<R> m_promise;
+    F m_func;
+    std::tuple<Args...> m_args;
+};
+
+
+// Result type of a ThreadPool::parallelFor(), which is run as a parallelReduce() that has nothing to reduce
+struct NoResult { };
+
+
+// Size that hot atomics are padded out to, to keep them off each other's cache lines
+constexpr size_t CACHE_LINE_SIZE = 64;
+
+
+// Monotonic time in nanoseconds, for the thread pool's metrics
+inline uint64_t nowNanoseconds() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+
+// Tell the CPU we are in a spin-wait loop
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+
+// A growable circular buffer of Jobs that can be pushed and popped at either end. Storage is only reallocated
+// when it fills up (doubling in size), so once it has grown to the working set it never allocates.
+class JobRing {
+public:
+
+    JobRing() : m_head(0), m_size(0) { }
+
+
+    bool empty() const {
+        return (m_size == 0);
+    }
+
+
+    size_t size() const {
+        return m_size;
+    }
+
+
+    void pushBack(Job&& job) {
+        if (m_size == m_jobs.size()) {
+            grow();
+        }
+        m_jobs[(m_head + m_size) & (m_jobs.size() - 1)] = std::move(job);
+        ++m_size;
+    }
+
+
+    void pushFront(Job&& job) {
+        if (m_size == m_jobs.size()) {
+            grow();
+        }
+        m_head = (m_head + m_jobs.size() - 1) & (m_jobs.size() - 1);
+        m_jobs[m_head] = std::move(job);
+        ++m_size;
+    }
+
+
+    void popFront(Job& job) {
+        job = std::move(m_jobs[m_head]);
+        m_head = (m_head + 1) & (m_jobs.size() - 1);
+        --m_size;
+    }
+
+
+    void popBack(Job& job) {
+        --m_size;
+        job = std::move(m_jobs[(m_head + m_size) & (m_jobs.size() - 1)]);
+    }
+
+
+    // Delete all jobs and return how many there were
+    size_t clear() {
+        size_t cleared = m_size;
+        for (size_t i = 0; i < m_size; ++i) {
+            m_jobs[(m_head + i) & (m_jobs.size() - 1)].reset();
+        }
+        m_head = 0;
+        m_size = 0;
+        return cleared;
+    }
+
+private:
+
+    static constexpr size_t MIN_CAPACITY = 16;   // must be a power of two
+
+
+    void grow() {
+        std::vector<Job> jobs(m_jobs.empty() ? MIN_CAPACITY : (m_jobs.size() * 2));
+        for (size_t i = 0; i < m_size; ++i) {
+            jobs[i] = std::move(m_jobs[(m_head + i) & (m_jobs.size() - 1)]);
+        }
+        m_jobs.swap(jobs);
+        m_head = 0;
+    }
+
+
+    std::vector<Job> m_jobs;    // size is always zero or a power of two
+    size_t m_head;
+    size_t m_size;
+};
+
+
+// Index of the lowest set bit of a non-zero mask
+inline unsigned lowestBit(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<unsigned>(__builtin_ctzll(mask));
+#else
+    unsigned bit = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+
+// Jobs waiting for a deadline, and a thread that hands each one to a thread pool once its deadline has passed
+// Timers are kept on a hierarchical timer wheel: LEVELS wheels of SLOTS slots, where a slot on each wheel spans a
+// whole turn of the wheel below. A timer goes on the list of the slot its deadline falls in, on the lowest wheel
+// that reaches that far, and each time a slot comes round its timers move down a wheel, until they are due. Adding
+// and cancelling a timer is O(1), and the thread only wakes when a slot with timers on it comes round. The pool is
+// type-erased (as with TaskGroup) so that this doesn't depend on its queue policy.
+class TimerService {
+public:
+
+    // Called by the timer thread to queue jobs that have fallen due
+    using SubmitFunc = void (*)(void* pool, std::vector<Job>& jobs);
+
+    // Resolution of timer deadlines
+    static constexpr uint64_t TICK_NS = 1000000;
+
+
+    TimerService(void* pool, SubmitFunc submit) :
+        m_pool(pool),
+        m_submit(submit),
+        m_epoch(std::chrono::steady_clock::now()),
+        m_current(0),
+        m_wake_tick(0),
+        m_shutdown(false),
+        m_free(nullptr),
+        m_count(0),
+        m_slots(),
+        m_occupied()
+    { }
+
+
+    TimerService(const TimerService&) = delete;
+    TimerService& operator=(const TimerService&) = delete;
+
+
+    ~TimerService() {
+        shutdown();
+    }
+
+
+    // Add a job to be handed to the pool once delay has passed, and then every period (if period isn't zero)
+    // Returns an id for cancel().
+    uint64_t add(Job&& work, std::chrono::nanoseconds delay, std::chrono::nanoseconds period) {
+        uint64_t deadline = (elapsedNanoseconds() + static_cast<uint64_t>(std::max<int64_t>(delay.count(), 0)) + TICK_NS - 1) / TICK_NS;
+
+        std::lock_guard<std::mutex> t_lk(m_mutex);
+        Timer& timer = allocateTimer();
+        timer.work = std::move(work);
+        timer.period = (period.count() > 0) ? std::max<uint64_t>((static_cast<uint64_t>(period.count()) + TICK_NS - 1) / TICK_NS, 1) : 0;
+        timer.deadline = std::max(deadline, m_current + 1);
+        timer.cancelled = false;
+        timer.state = TimerState::Waiting;
+        insert(timer);
+
+        if (!m_thread) {
+            m_thread = std::make_unique<std::thread>(&TimerService::timerLoop, this);
+        } else if (timer.deadline < m_wake_tick) {
+            m_cv.notify_one();
+        }
+        return (static_cast<uint64_t>(timer.generation) << 32) | timer.index;
+    }
+
+
+    // Cancel a timer, returning false if it had already fallen due (or was cancelled before)
+    // A periodic timer's job that has been handed to the pool is left to finish, and isn't added again.
+    bool cancel(uint64_t id) {
+        Job work;   // destroyed once the lock is released, in case it cancels other timers as it goes
+        std::lock_guard<std::mutex> t_lk(m_mutex);
+        size_t index = static_cast<size_t>(id & 0xffffffff);
+        if (index >= m_timers.size()) {
+            return false;
+        }
+        Timer& timer = *m_timers[index];
+        if ((timer.generation != (id >> 32)) || (timer.state == TimerState::Free) || timer.cancelled) {
+            return false;
+        }
+        if (timer.state == TimerState::Waiting) {
+            unlink(timer);
+            work = std::move(timer.work);
+            releaseTimer(timer);
+        } else {
+            timer.cancelled = true;
+        }
+        return true;
+    }
+
+
+    // Cancel every timer and return how many there were
+    size_t cancelAll() {
+        std::vector<Job> works;
+        std::lock_guard<std::mutex> t_lk(m_mutex);
+        size_t cancelled = 0;
+        for (const auto& timer : m_timers) {
+            if (timer->state == TimerState::Waiting) {
+                unlink(*timer);
+                works.push_back(std::move(timer->work));
+                releaseTimer(*timer);
+                ++cancelled;
+            } else if ((timer->state == TimerState::Fired) && !timer->cancelled) {
+                timer->cancelled = true;
+                ++cancelled;
+            }
+        }
+        return cancelled;
+    }
+
+
+    // Get the number of timers that haven't been cancelled or fallen due for the last time
+    size_t size() {
+        std::lock_guard<std::mutex> t_lk(m_mutex);
+        return m_count;
+    }
+
+
+    // Stop the timer thread, without handing any more jobs to the pool
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> t_lk(m_mutex);
+            m_shutdown = true;
+            m_cv.notify_one();
+        }
+        if (m_thread) {
+            m_thread->join();
+            m_thread.reset();
+        }
+    }
+
+private:
+
+    enum class TimerState {
+        Free,
+        Waiting,        // on the wheel
+        Fired           // a periodic timer whose job has been handed to the pool, see FiredTimer
+    };
+
+
+    struct Timer {
+        Job work;
+        uint64_t deadline;      // in ticks since m_epoch
+        uint64_t period;        // in ticks, 0 if not periodic
+        uint32_t generation;    // incremented as the timer is freed, so that old ids no longer match it
+        uint32_t index;         // in m_timers
+        TimerState state;
+        bool cancelled;
+        size_t level;
+        size_t slot;
+        Timer* prev;
+        Timer* next;            // on its slot's list, or the free list
+    };
+
+
+    // The job handed to the pool for a periodic timer, which runs the timer's job and, as it is destroyed (whether
+    // it has been run or cleared from the queue), puts the timer back on the wheel for its next deadline. So a
+    // periodic job is never queued again before its last run has finished.
+    class FiredTimer {
+    public:
+        FiredTimer(TimerService& service, Timer& timer) : m_service(&service), m_timer(&timer) { }
+
+
+        FiredTimer(FiredTimer&& other) noexcept : m_service(other.m_service), m_timer(other.m_timer) {
+            other.m_timer = nullptr;
+        }
+
+
+        FiredTimer& operator=(FiredTimer&&) = delete;
+
+
+        ~FiredTimer() {
+            if (m_timer != nullptr) {
+                m_service->rearm(*m_timer);
+            }
+        }
+
+
+        void operator()() {
+            m_timer->work();
+        }
+
+    private:
+        TimerService* m_service;
+        Timer* m_timer;
+    };
+
+
+    static constexpr size_t LEVELS = 4;
+    static constexpr size_t SLOT_BITS = 6;
+    static constexpr size_t SLOTS = size_t(1) << SLOT_BITS;
+    static constexpr uint64_t NEVER = static_cast<uint64_t>(-1);
+
+
+    uint64_t elapsedNanoseconds() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_epoch).count());
+    }
+
+
+    Timer& allocateTimer() {
+        Timer* timer = m_free;
+        if (timer != nullptr) {
+            m_free = timer->next;
+        } else {
+            m_timers.emplace_back(std::make_unique<Timer>());
+            timer = m_timers.back().get();
+            timer->generation = 0;
+            timer->index = static_cast<uint32_t>(m_timers.size() - 1);
+        }
+        ++m_count;
+        return *timer;
+    }
+
+
+    void releaseTimer(Timer& timer) {
+        ++timer.generation;
+        timer.state = TimerState::Free;
+        timer.next = m_free;
+        m_free = &timer;
+        --m_count;
+    }
+
+
+    // Put a timer on the wheel, in the slot for its deadline (which must not be before m_current)
+    // Deadlines beyond the top wheel go in its furthest slot, and are placed again from there as it comes round.
+    void insert(Timer& timer) {
+        uint64_t delta = timer.deadline - m_current;
+        uint64_t deadline = timer.deadline;
+        size_t level = 0;
+        while ((level < LEVELS - 1) && (delta >= (uint64_t(1) << ((level + 1) * SLOT_BITS)))) {
+            ++level;
+        }
+        if (delta >= (uint64_t(1) << (LEVELS * SLOT_BITS))) {
+            deadline = m_current + (uint64_t(1) << (LEVELS * SLOT_BITS)) - 1;
+        }
+        timer.level = level;
+        timer.slot = static_cast<size_t>(deadline >> (level * SLOT_BITS)) & (SLOTS - 1);
+
+        Timer*& head = m_slots[timer.level][timer.slot];
+        timer.prev = nullptr;
+        timer.next = head;
+        if (head != nullptr) {
+            head->prev = &timer;
+        }
+        head = &timer;
+        m_occupied[timer.level] |= (uint64_t(1) << timer.slot);
+    }
+
+
+    void unlink(Timer& timer) {
+        if (timer.prev != nullptr) {
+            timer.prev->next = timer.next;
+        } else {
+            m_slots[timer.level][timer.slot] = timer.next;
+            if (timer.next == nullptr) {
+                m_occupied[timer.level] &= ~(uint64_t(1) << timer.slot);
+            }
+        }
+        if (timer.next != nullptr) {
+            timer.next->prev = timer.prev;
+        }
+    }
+
+
+    // Take the list of timers off a slot
+    Timer* takeSlot(size_t level, size_t slot) {
+        Timer* list = m_slots[level][slot];
+        m_slots[level][slot] = nullptr;
+        m_occupied[level] &= ~(uint64_t(1) << slot);
+        return list;
+    }
+
+
+    // Get the next tick after m_current at which a slot with timers on it comes round, or NEVER
+    uint64_t nextEventTick() {
+        uint64_t next = NEVER;
+        for (size_t level = 0; level < LEVELS; ++level) {
+            uint64_t occupied = m_occupied[level];
+            if (occupied == 0) {
+                continue;
+            }
+            size_t shift = level * SLOT_BITS;
+            uint64_t turn = m_current >> shift;
+            // rotate the mask so that bit 0 is the slot after the current one
+            size_t rotate = static_cast<size_t>(turn + 1) & (SLOTS - 1);
+            uint64_t ahead = (rotate == 0) ? occupied : ((occupied >> rotate) | (occupied << (SLOTS - rotate)));
+            next = std::min(next, (turn + lowestBit(ahead) + 1) << shift);
+        }
+        return next;
+    }
+
+
+    // Move the wheel on to now, adding the jobs of timers that fall due to due
+    void advance(uint64_t now, std::vector<Job>& due) {
+        while (true) {
+            uint64_t next = nextEventTick();
+            if (next > now) {
+                m_current = std::max(m_current, now);
+                return;
+            }
+            m_current = next;
+
+            // move timers down from the wheels that have come round, top wheel first
+            for (size_t level = LEVELS - 1; level > 0; --level) {
+                if ((m_current & ((uint64_t(1) << (level * SLOT_BITS)) - 1)) == 0) {
+                    Timer* timer = takeSlot(level, static_cast<size_t>(m_current >> (level * SLOT_BITS)) & (SLOTS - 1));
+                    while (timer != nullptr) {
+                        Timer* next_timer = timer->next;
+                        insert(*timer);
+                        timer = next_timer;
+                    }
+                }
+            }
+
+            Timer* timer = takeSlot(0, static_cast<size_t>(m_current) & (SLOTS - 1));
+            while (timer != nullptr) {
+                Timer* next_timer = timer->next;
+                if (timer->period == 0) {
+                    due.push_back(std::move(timer->work));
+                    releaseTimer(*timer);
+                } else {
+                    timer->state = TimerState::Fired;
+                    due.emplace_back(FiredTimer(*this, *timer));
+                }
+                timer = next_timer;
+            }
+        }
+    }
+
+
+    // Put a periodic timer back on the wheel after its job has finished, or free it if it has been cancelled
+    void rearm(Timer& timer) {
+        Job work;
+        std::lock_guard<std::mutex> t_lk(m_mutex);
+        if (timer.cancelled || m_shutdown) {
+            work = std::move(timer.work);
+            releaseTimer(timer);
+            return;
+        }
+        uint64_t now = std::max(elapsedNanoseconds() / TICK_NS, m_current);
+        uint64_t deadline = timer.deadline + timer.period;
+        if (deadline <= now) {
+            deadline += ((now - deadline) / timer.period + 1) * timer.period;   // skip the runs we have missed
+        }
+        timer.deadline = deadline;
+        timer.state = TimerState::Waiting;
+        insert(timer);
+        if (deadline < m_wake_tick) {
+            m_cv.notify_one();
+        }
+    }
+
+
+    void timerLoop() {
+        std::vector<Job> due;
+        std::unique_lock<std::mutex> t_lk(m_mutex);
+        while (!m_shutdown) {
+            advance(elapsedNanoseconds() / TICK_NS, due);
+            if (!due.empty()) {
+                t_lk.unlock();
+                m_submit(m_pool, due);
+                due.clear();
+                t_lk.lock();
+                continue;
+            }
+
+            m_wake_tick = nextEventTick();
+            if (m_wake_tick == NEVER) {
+                m_cv.wait(t_lk);
+            } else {
+                m_cv.wait_until(t_lk, m_epoch + std::chrono::nanoseconds(m_wake_tick * TICK_NS));
+            }
+            m_wake_tick = 0;    // awake, so nobody needs to notify us
+        }
+    }
+
+
+    void* m_pool;
+    SubmitFunc m_submit;
+    const std::chrono::steady_clock::time_point m_epoch;
+
+    std::mutex m_mutex;                 // guards everything below
+    std::condition_variable m_cv;
+    std::unique_ptr<std::thread> m_thread;
+    uint64_t m_current;                 // the tick the wheel has been moved on to
+    uint64_t m_wake_tick;               // the tick the timer thread is sleeping until, 0 while it is awake
+    bool m_shutdown;
+
+    std::vector<std::unique_ptr<Timer>> m_timers;
+    Timer* m_free;
+    size_t m_count;
+    Timer* m_slots[LEVELS][SLOTS];
+    uint64_t m_occupied[LEVELS];        // bit per slot with timers on it
+};
+
+
+// Parse a Linux cpu or node list such as "0-3,8-11" into the numbers it contains
+inline std::vector<unsigned> parseIdList(const std::string& list) {
+    std::vector<unsigned> ids;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        std::string range = list.substr(pos, (end == std::string::npos) ? std::string::npos : (end - pos));
+        size_t dash = range.find('-');
+        try {
+            unsigned first = static_cast<unsigned>(std::stoul(range.substr(0, dash)));
+            unsigned last = (dash == std::string::npos) ? first : static_cast<unsigned>(std::stoul(range.substr(dash + 1)));
+            for (unsigned id = first; id <= last; ++id) {
+                ids.push_back(id);
+            }
+        } catch (const std::exception&) {
+            return {};
+        }
+        pos = (end == std::string::npos) ? list.size() : (end + 1);
+    }
+    return ids;
+}
+
+
+inline std::string readFirstLine(const std::string& path) {
+    std::ifstream file(path);
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+
+
+// The cpus of each of the machine's online NUMA nodes, read from sysfs on Linux. Anywhere else (or if sysfs
+// can't be read) the machine is treated as a single node with every hardware thread on it.
+inline const std::vector<std::vector<unsigned>>& numaNodeCpus() {
+    static const std::vector<std::vector<unsigned>> node_cpus = [](){
+        std::vector<std::vector<unsigned>> nodes;
+#ifdef __linux__
+        for (unsigned node : parseIdList(readFirstLine("/sys/devices/system/node/online"))) {
+            std::vector<unsigned> cpus = parseIdList(readFirstLine("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"));
+            if (!cpus.empty()) {
+                nodes.push_back(cpus);
+            }
+        }
+#endif
+        if (nodes.empty()) {
+            nodes.emplace_back();
+            for (unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); ++cpu) {
+                nodes.back().push_back(cpu);
+            }
+        }
+        return nodes;
+    }();
+    return node_cpus;
+}
+
+
+// Restrict the calling thread to the given cpus (does nothing if the platform doesn't support it)
+inline bool pinCurrentThread(const std::vector<unsigned>& cpus) {
+#ifdef __linux__
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (unsigned cpu : cpus) {
+        if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &cpu_set);
+        }
+    }
+    return (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) == 0);
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+
+// What happened to a job, for JobTrace
+enum class TraceEventType : uint32_t {
+    Queued,
+    Dequeued,   // taken by the worker (or helping thread) that will run it
+    Started,
+    Finished
+};
+
+
+#ifdef CPP_TP_TRACE
+
+struct TraceEvent {
+    uint64_t time;  // nowNanoseconds()
+    uint64_t job;   // Job::traceId()
+    TraceEventType type;
+};
+
+
+// A ring of the latest TRACE_CAPACITY events recorded by one thread, written by that thread alone
+// Buffers are kept after their thread exits, so that the trace still covers workers that have been stopped, until
+// the trace has been written or cleared. A new thread then reuses the buffer, carrying on its job ids (so that they
+// stay unique) and its tid in the trace.
+struct TraceBuffer {
+    static constexpr size_t TRACE_CAPACITY = 65536;     // a power of two
+
+    explicit TraceBuffer(size_t buffer_index) : events(new TraceEvent[TRACE_CAPACITY]), written(0), index(buffer_index), next_job(0), exited(false) { }
+
+    std::unique_ptr<TraceEvent[]> events;
+    std::atomic<uint64_t> written;
+    const size_t index;
+    uint64_t next_job;
+    std::string name;   // guarded by the registry's mutex
+    bool exited;        // guarded by the registry's mutex, true once the thread has exited until the buffer is free
+};
+
+
+struct TraceRegistry {
+    std::mutex mutex;   // only taken when a thread starts or stops recording, and to write or clear the trace
+    std::vector<std::unique_ptr<TraceBuffer>> buffers;
+    std::vector<TraceBuffer*> free_buffers;     // of threads that have exited, ready for new threads
+
+    // Free the buffers of threads that have exited, once their events have been written or cleared
+    void freeExitedBuffers() {
+        for (const auto& buffer : buffers) {
+            if (buffer->exited) {
+                buffer->exited = false;
+                free_buffers.push_back(buffer.get());
+            }
+        }
+    }
+};
+
+
+// Never destroyed, as threads may still be exiting after static destructors have run
+inline TraceRegistry& traceRegistry() {
+    static TraceRegistry* registry = new TraceRegistry();
+    return *registry;
+}
+
+
+// The calling thread's hold on a buffer, taken when it first records an event and given back when it exits
+class TraceBufferLease {
+public:
+
+    TraceBufferLease() {
+        TraceRegistry& registry = traceRegistry();
+        std::lock_guard<std::mutex> t_lk(registry.mutex);
+        if (!registry.free_buffers.empty()) {
+            m_buffer = registry.free_buffers.back();
+            registry.free_buffers.pop_back();
+            m_buffer->written.store(0, std::memory_order_relaxed);
+        } else {
+            registry.buffers.emplace_back(new TraceBuffer(registry.buffers.size()));
+            m_buffer = registry.buffers.back().get();
+        }
+        m_buffer->name = "thread " + std::to_string(m_buffer->index);
+    }
+
+
+    TraceBufferLease(const TraceBufferLease&) = delete;
+
+
+    ~TraceBufferLease() {
+        TraceRegistry& registry = traceRegistry();
+        std::lock_guard<std::mutex> t_lk(registry.mutex);
+        if (m_buffer->written.load(std::memory_order_relaxed) == 0) {
+            registry.free_buffers.push_back(m_buffer);      // nothing in it to keep for the trace
+        } else {
+            m_buffer->exited = true;
+        }
+    }
+
+
+    TraceBuffer& buffer() {
+        return *m_buffer;
+    }
+
+private:
+
+    TraceBuffer* m_buffer;
+};
+
+
+inline TraceBuffer& traceBuffer() {
+    static thread_local TraceBufferLease lease;
+    return lease.buffer();
+}
+
+
+inline void traceEvent(TraceEventType type, uint64_t job) {
+    TraceBuffer& buffer = traceBuffer();
+    uint64_t written = buffer.written.load(std::memory_order_relaxed);
+    buffer.events[written & (TraceBuffer::TRACE_CAPACITY - 1)] = TraceEvent{nowNanoseconds(), job, type};
+    buffer.written.store(written + 1, std::memory_order_release);
+}
+
+
+// Give a job queued by the calling thread an id that is unique without being shared between threads
+inline uint64_t traceQueuedJob() {
+    TraceBuffer& buffer = traceBuffer();
+    uint64_t job = (static_cast<uint64_t>(buffer.index + 1) << 40) | (++buffer.next_job & ((uint64_t(1) << 40) - 1));
+    traceEvent(TraceEventType::Queued, job);
+    return job;
+}
+
+
+inline void traceWorkerStarted(const void* pool, size_t id) {
+    TraceBuffer& buffer = traceBuffer();
+    uintptr_t address = reinterpret_cast<uintptr_t>(pool);
+    std::string hex;
+    do {
+        hex.insert(hex.begin(), "0123456789abcdef"[address & 0xf]);
+        address >>= 4;
+    } while (address != 0);
+    TraceRegistry& registry = traceRegistry();
+    std::lock_guard<std::mutex> t_lk(registry.mutex);
+    buffer.name = "worker " + std::to_string(id) + " of pool 0x" + hex;
+}
+
+#else
+
+inline void traceEvent(TraceEventType, uint64_t) { }
+
+inline uint64_t traceQueuedJob() {
+    return 0;
+}
+
+inline void traceWorkerStarted(const void*, size_t) { }
+
+#endif
+
+}   // namespace tp_detail
+
+
+// A timeline of the jobs run by every thread pool in the process, for chrome://tracing or ui.perfetto.dev
+// Only recorded when CPP_TP_TRACE is defined before including cpp-tp.hpp, and otherwise the recording compiles away
+// to nothing, leaving the trace empty. Each thread records when it queues a job, and when it takes, starts and
+// finishes one, in a ring buffer of its own that keeps its latest 65536 events, so that recording takes no lock.
+// The trace shows each job as a slice on the thread that ran it, with an arrow from where it was queued, so queueing
+// delay, time spent fetching jobs and long jobs can be told apart. Write or clear it while the pools are idle (eg
+// after wait()), as events recorded while it is being read may be garbled. The buffers of threads that have exited
+// are reused by new threads once the trace has been written or cleared, so threads coming and going (eg with
+// WorkerScaling) don't grow memory as long as the trace is written or cleared now and then.
+class JobTrace {
+public:
+
+#ifdef CPP_TP_TRACE
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+
+
+    // Write the trace as Chrome trace event JSON, which Perfetto opens as well
+    static void write(std::ostream& out) {
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+#ifdef CPP_TP_TRACE
+        tp_detail::TraceRegistry& registry = tp_detail::traceRegistry();
+        std::lock_guard<std::mutex> t_lk(registry.mutex);
+
+        uint64_t origin = UINT64_MAX;
+        for (const auto& buffer : registry.buffers) {
+            uint64_t written = buffer->written.load(std::memory_order_acquire);
+            if (written > 0) {
+                origin = std::min(origin, buffer->events[firstEvent(written) & (tp_detail::TraceBuffer::TRACE_CAPACITY - 1)].time);
+            }
+        }
+
+        const char* separator = "";
+        for (const auto& buffer : registry.buffers) {
+            out << separator << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << buffer->index
+                << ",\"args\":{\"name\":\"" << buffer->name << "\"}}";
+            separator = ",";
+
+            uint64_t written = buffer->written.load(std::memory_order_acquire);
+            for (uint64_t i = firstEvent(written); i < written; ++i) {
+                const tp_detail::TraceEvent& event = buffer->events[i & (tp_detail::TraceBuffer::TRACE_CAPACITY - 1)];
+                writeEvent(out, event, buffer->index, event.time - origin);
+            }
+        }
+        registry.freeExitedBuffers();
+#endif
+        out << "]}" << std::endl;
+    }
+
+
+    // Write the trace to a file, returning false if it couldn't be written
+    static bool writeFile(const std::string& path) {
+        std::ofstream out(path);
+        write(out);
+        return static_cast<bool>(out);
+    }
+
+
+    // Forget every event recorded so far
+    static void clear() {
+#ifdef CPP_TP_TRACE
+        tp_detail::TraceRegistry& registry = tp_detail::traceRegistry();
+        std::lock_guard<std::mutex> t_lk(registry.mutex);
+        for (const auto& buffer : registry.buffers) {
+            buffer->written.store(0, std::memory_order_release);
+        }
+        registry.freeExitedBuffers();
+#endif
+    }
+
+private:
+
+#ifdef CPP_TP_TRACE
+    static uint64_t firstEvent(uint64_t written) {
+        size_t capacity = tp_detail::TraceBuffer::TRACE_CAPACITY;
+        return (written > capacity) ? (written - capacity) : 0;
+    }
+
+
+    static void writeEvent(std::ostream& out, const tp_detail::TraceEvent& event, size_t tid, uint64_t ns) {
+        // microseconds, with the nanoseconds after the point and no floating point rounding
+        std::string ts = std::to_string(ns / 1000) + "." + std::to_string(1000 + (ns % 1000)).substr(1);
+        std::string common = ",\"pid\":1,\"tid\":" + std::to_string(tid) + ",\"ts\":" + ts;
+        std::string id = std::to_string(event.job);
+
+        switch (event.type) {
+        case tp_detail::TraceEventType::Queued:
+            out << ",{\"ph\":\"i\",\"s\":\"t\",\"name\":\"queued\",\"cat\":\"job\"" << common << ",\"args\":{\"job\":" << id << "}}"
+                << ",{\"ph\":\"s\",\"name\":\"job\",\"cat\":\"job\",\"id\":" << id << common << "}";
+            break;
+        case tp_detail::TraceEventType::Dequeued:
+            out << ",{\"ph\":\"i\",\"s\":\"t\",\"name\":\"dequeued\",\"cat\":\"job\"" << common << ",\"args\":{\"job\":" << id << "}}";
+            break;
+        case tp_detail::TraceEventType::Started:
+            out << ",{\"ph\":\"B\",\"name\":\"job\",\"cat\":\"job\"" << common << ",\"args\":{\"job\":" << id << "}}"
+                << ",{\"ph\":\"f\",\"bp\":\"e\",\"name\":\"job\",\"cat\":\"job\",\"id\":" << id << common << "}";
+            break;
+        case tp_detail::TraceEventType::Finished:
+            out << ",{\"ph\":\"E\"" << common << "}";
+            break;
+        }
+    }
+#endif
+};
+
+
+// Queue policies for BasicThreadPool
+// A queue policy is a thread-safe FIFO of Jobs with the members below. The try...() members never block waiting
+// for space or for jobs, and a push that fails leaves the job (or jobs) it was passed untouched.
+//   bool tryPush(Job& job)                           - move job onto the queue, false if it is full
+//   size_t tryPushBulk(Job* jobs, size_t count)      - move the first n <= count jobs onto the queue and return n
+//   bool tryPop(Job& job)                            - move the front job into job, false if the queue is empty
+//   size_t tryPopBulk(Job* jobs, size_t max_count)   - move up to max_count front jobs into jobs and return how many
+//   size_t clear()                                   - delete all queued jobs and return how many there were
+//   size_t size()                                    - number of queued jobs (may be stale by the time it returns)
+
+
+// Unbounded queue policy (the default) - a growable ring buffer protected by a mutex
+class UnboundedQueue {
+public:
+
+    UnboundedQueue() { }
+
+
+    UnboundedQueue(const UnboundedQueue&) = delete;
+
+
+    bool tryPush(Job& job) {
+        std::lock_guard<std::mutex> q_lk(m_mutex);
+        m_jobs.pushBack(std::move(job));
+        return true;
+    }
+
+
+    size_t tryPushBulk(Job* jobs, size_t count) {
+        std::lock_guard<std::mutex> q_lk(m_mutex);
+        for (size_t i = 0; i < count; ++i) {
+            m_jobs.pushBack(std::move(jobs[i]));
+        }
+        return count;
+    }
+
+
+    bool tryPop(Job& job) {
+        std::lock_guard<std::mutex> q_lk(m_mutex);
+        if (m_jobs.empty()) {
+            return false;
+        }
+        m_jobs.popFront(job);
+        return true;
+    }
+
+
+    size_t tryPopBulk(Job* jobs, size_t max_count) {
+        std::lock_guard<std::mutex> q_lk(m_mutex);
+        size_t count = (m_jobs.size() < max_count) ? m_jobs.size() : max_count;
+        for (size_t i = 0; i < count; ++i) {
+            m_jobs.popFront(jobs[i]);
+        }
+        return count;
+    }
+
+
+    size_t clear() {
+        std::lock_guard<std::mutex> q_lk(m_mutex);
+        return m_jobs.clear();
+    }
+
+
+    size_t size() {
+        std::lock_guard<std::mutex> q_lk(m_mutex);
+        return m_jobs.size();
+    }
+
+private:
+
+    std::mutex m_mutex;
+    tp_detail::JobRing m_jobs;
+};
+
+
+// Bounded lock-free queue policy - Dmitry Vyukov's multi-producer multi-consumer ring buffer
+// Each cell carries a sequence number that tells producers and consumers whose turn it is, so a push or pop is a
+// single CAS on the enqueue or dequeue position, which are kept on separate cache lines. Capacity must be a power
+// of two. When the ring is full ThreadPool::addJob() yields until a worker has made space (addJobFor() only until
+// its timeout, and tryAddJob() returns false), unless the pool has a queue capacity no larger than Capacity to wait
+// for instead (see BasicThreadPool::setQueueCapacity()). A job added by one of the pool's own jobs while the ring is
+// full doesn't wait, as all of the workers could be waiting with none left to make space, and is run straight away
+// by the worker adding it instead.
+template<size_t Capacity>
+class BoundedMpmcQueue {
+public:
+
+    static_assert((Capacity >= 2) && ((Capacity & (Capacity - 1)) == 0), "BoundedMpmcQueue capacity must be a power of two");
+
+
+    BoundedMpmcQueue() :
+        m_enqueue_pos(0),
+        m_dequeue_pos(0),
+        m_cells(new Cell[Capacity])
+    {
+        for (size_t i = 0; i < Capacity; ++i) {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+
+    BoundedMpmcQueue(const BoundedMpmcQueue&) = delete;
+
+
+    bool tryPush(Job& job) {
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        Cell* cell;
+
+        while (true) {
+            cell = &m_cells[pos & (Capacity - 1)];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (difference == 0) {
+                if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return false;   // full
+            } else {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->job = std::move(job);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+
+    size_t tryPushBulk(Job* jobs, size_t count) {
+        size_t pushed = 0;
+        while ((pushed < count) && tryPush(jobs[pushed])) {
+            ++pushed;
+        }
+        return pushed;
+    }
+
+
+    bool tryPop(Job& job) {
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        Cell* cell;
+
+        while (true) {
+            cell = &m_cells[pos & (Capacity - 1)];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+            if (difference == 0) {
+                if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return false;   // empty
+            } else {
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        job = std::move(cell->job);
+        cell->sequence.store(pos + Capacity, std::memory_order_release);
+        return true;
+    }
+
+
+    size_t tryPopBulk(Job* jobs, size_t max_count) {
+        size_t popped = 0;
+        while ((popped < max_count) && tryPop(jobs[popped])) {
+            ++popped;
+        }
+        return popped;
+    }
+
+
+    size_t clear() {
+        size_t cleared = 0;
+        Job job;
+        while (tryPop(job)) {
+            job.reset();
+            ++cleared;
+        }
+        return cleared;
+    }
+
+
+    size_t size() {
+        size_t dequeue_pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        size_t enqueue_pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        return (enqueue_pos > dequeue_pos) ? (enqueue_pos - dequeue_pos) : 0;
+    }
+
+private:
+
+    struct Cell {
+        std::atomic<size_t> sequence;
+        Job job;
+    };
+
+
+    std::atomic<size_t> m_enqueue_pos;
+    char m_enqueue_pad[tp_detail::CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> m_dequeue_pos;
+    char m_dequeue_pad[tp_detail::CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    std::unique_ptr<Cell[]> m_cells;
+};
+
+
+// How a worker with nothing to do waits for a new job
+// It first checks for one spin_count times with a CPU pause in between, then yield_count times yielding the rest of
+// its time slice in between, and then sleeps until it is woken by a new job. Spinning keeps a worker responsive to
+// bursty submission at the cost of burning CPU while idle. Used by pools with the AdaptiveIdle policy (the default).
+struct IdleStrategy {
+    size_t spin_count = 1024;
+    size_t yield_count = 16;
+};
+
+
+// How many times idle workers have entered each phase of their IdleStrategy
+// Each idle period enters the spin phase, and only goes on to yield and then to sleep if no job turned up, so
+// spins - yields is the number of idle periods that ended while spinning, and so on.
+struct IdleStats {
+    uint64_t spins = 0;
+    uint64_t yields = 0;
+    uint64_t parks = 0;
+};
+
+
+// The phases of waiting for a job before an idle worker goes to sleep
+enum class IdlePhase {
+    Spin,
+    Yield
+};
+
+
+// Idle policies for BasicThreadPool
+// An idle policy decides how a worker with nothing to do waits for a job before it goes to sleep until woken, with
+// the member below. As it is a template parameter, the wait compiles down to just the loops the policy has.
+//   template<typename Woken, typename Entered>
+//   bool wait(const IdleStrategy& strategy, Woken woken, Entered entered)
+//       - return true as soon as woken() does, or false to go to sleep, calling entered(phase) for each IdlePhase
+//         it goes into, for the pool's IdleStats
+
+
+namespace tp_detail {
+
+template<typename Woken, typename Entered>
+bool spinThenYield(size_t spin_count, size_t yield_count, Woken& woken, Entered& entered) {
+    if (spin_count > 0) {
+        entered(IdlePhase::Spin);
+        for (size_t spin = 0; spin < spin_count; ++spin) {
+            if (woken()) {
+                return true;
+            }
+            cpuRelax();
+        }
+    }
+
+    if (yield_count > 0) {
+        entered(IdlePhase::Yield);
+        for (size_t yield = 0; yield < yield_count; ++yield) {
+            if (woken()) {
+                return true;
+            }
+            std::this_thread::yield();
+        }
+    }
+    return false;
+}
+
+}   // namespace tp_detail
+
+
+// Idle policy (the default) that spins and yields as many times as the pool's IdleStrategy says
+struct AdaptiveIdle {
+    template<typename Woken, typename Entered>
+    bool wait(const IdleStrategy& strategy, Woken woken, Entered entered) {
+        return tp_detail::spinThenYield(strategy.spin_count, strategy.yield_count, woken, entered);
+    }
+};
+
+
+// Idle policy that spins SpinCount times and yields YieldCount times, whatever the pool's IdleStrategy
+template<size_t SpinCount, size_t YieldCount>
+struct FixedIdle {
+    template<typename Woken, typename Entered>
+    bool wait(const IdleStrategy&, Woken woken, Entered entered) {
+        return tp_detail::spinThenYield(SpinCount, YieldCount, woken, entered);
+    }
+};
+
+
+// Idle policy that goes straight to sleep, for pools sharing their cpus with other busy threads
+using SleepingIdle = FixedIdle<0, 0>;
+
+
+// Counters of one worker, or of all of them added up, as returned by BasicThreadPool::snapshot()
+struct WorkerMetrics {
+
+    // Buckets of the queue wait histogram, of a sample of one in 16 jobs: queue_wait[0] counts jobs that waited
+    // under 1 microsecond before a worker started running them, queue_wait[i] those that waited [2^(i-1), 2^i)
+    // microseconds, and the last bucket everything longer than that (about 4 seconds and up).
+    static constexpr size_t QUEUE_WAIT_BUCKETS = 24;
+
+
+    uint64_t jobs_executed = 0;
+    uint64_t busy_ns = 0;           // time spent running (and fetching) jobs
+    uint64_t idle_ns = 0;           // time spent waiting for jobs to be queued
+    uint64_t steals = 0;            // jobs taken from other workers' deques, when work stealing
+    uint64_t peak_queue_depth = 0;  // most jobs seen queued (and not yet started) as a job started, the maximum for totals
+    uint64_t queue_wait[QUEUE_WAIT_BUCKETS] = {};
+    IdleStats idle;
+};
+
+
+// Metrics of a whole thread pool, as returned by BasicThreadPool::snapshot()
+struct PoolMetrics {
+    std::vector<WorkerMetrics> workers;     // includes workers that are currently stopped
+    WorkerMetrics total;
+    size_t pending_jobs = 0;
+    size_t queued_jobs = 0;
+    uint64_t job_errors = 0;                // exceptions passed to the pool's error handler, see setErrorHandler()
+    uint64_t cancelled_jobs = 0;            // jobs skipped as they had been cancelled, see CancellationSource
+};
+
+
+// Metrics policies for BasicThreadPool
+// A metrics policy has a static constexpr bool enabled, for whether workers keep the counters of the WorkerMetrics
+// in snapshot(). Without them a worker reads the clock only when an elastic pool needs it, and snapshot() leaves
+// the WorkerMetrics at zero while still reporting the pool's job, error and cancellation counts.
+struct CountMetrics {
+    static constexpr bool enabled = true;   // the default
+};
+
+
+struct NoMetrics {
+    static constexpr bool enabled = false;
+};
+
+
+// Where BasicThreadPool::start() runs its worker threads
+// NUMA nodes are numbered 0 to numa_node_count - 1 in the order the OS lists its online nodes, which is normally
+// just the node number.
+struct WorkerPlacement {
+
+    enum class Mode {
+        Anywhere,           // leave it to the OS scheduler
+        Pinned,             // worker i may only run on the cpus in core_sets[i % core_sets.size()]
+        SpreadNumaNodes     // worker i may only run on the cpus of NUMA node i % numa_node_count
+    };
+
+
+    // Let the OS schedule workers on any cpu (the default)
+    static WorkerPlacement anywhere() {
+        return WorkerPlacement();
+    }
+
+
+    // Pin each worker to a set of cpus, eg: pinned({{0}, {1}, {2}, {3}}) gives one core to each of 4 workers
+    static WorkerPlacement pinned(std::vector<std::vector<unsigned>> core_sets) {
+        WorkerPlacement placement;
+        placement.mode = core_sets.empty() ? Mode::Anywhere : Mode::Pinned;
+        placement.core_sets = std::move(core_sets);
+        return placement;
+    }
+
+
+    // Deal workers out across NUMA nodes, each free to run on any cpu of its node
+    static WorkerPlacement spreadNumaNodes() {
+        WorkerPlacement placement;
+        placement.mode = Mode::SpreadNumaNodes;
+        return placement;
+    }
+
+
+    Mode mode = Mode::Anywhere;
+    std::vector<std::vector<unsigned>> core_sets;
+};
+
+
+// How a BasicThreadPool changes its number of workers while it runs
+// With a fixed worker count (the default) workers are only started and stopped by start(), stop() and resize(). An
+// elastic pool also starts another worker, up to max_workers, whenever none are idle and either more than
+// queue_depth jobs per worker are queued or a job has waited longer than queue_wait to start. Workers that have been
+// asleep for idle_timeout with nothing to do are retired, down to min_workers.
+struct WorkerScaling {
+
+    enum class Mode {
+        Fixed,
+        Elastic
+    };
+
+
+    // Only change the number of workers when asked to (the default)
+    static WorkerScaling fixed() {
+        return WorkerScaling();
+    }
+
+
+    // Scale between min_workers and max_workers (0 = number of hardware threads) with the load
+    static WorkerScaling elastic(size_t min_workers, size_t max_workers) {
+        WorkerScaling scaling;
+        scaling.mode = Mode::Elastic;
+        scaling.min_workers = min_workers;
+        scaling.max_workers = max_workers;
+        return scaling;
+    }
+
+
+    Mode mode = Mode::Fixed;
+    size_t min_workers = 0;
+    size_t max_workers = 0;
+    size_t queue_depth = 16;
+    std::chrono::microseconds queue_wait = std::chrono::milliseconds(1);
+    std::chrono::milliseconds idle_timeout = std::chrono::seconds(5);
+};
+
+
+// Priority lanes for BasicThreadPool::addJob()
+// Each lane is its own FIFO queue, and workers take jobs from higher lanes first. So that a flood of higher
+// priority jobs can't starve the lower lanes completely, a worker takes a job from a waiting lower lane after
+// passing it over 16 times in a row.
+enum class Priority {
+    High = 0,
+    Normal = 1,     // as used by addJob(work_func)
+    Low = 2
+};
+
+
+// Submission hint for BasicThreadPool::addJob(), to prefer running a job on a worker placed on a NUMA node
+struct NumaNode {
+    size_t index;
+};
+
+
+// Submission hint for BasicThreadPool::addJob(), to run a job after the others with the same key, on the same worker
+// Keys are compared by hash alone, so use of() to make one from anything that std::hash can hash.
+struct AffinityKey {
+    size_t hash;
+
+    template<typename Key>
+    static AffinityKey of(const Key& key) {
+        return AffinityKey{std::hash<Key>()(key)};
+    }
+};
+
+
+// Handle to a job added with BasicThreadPool::addJobAfter() or addJobEvery(), to cancel it with cancelTimer()
+struct TimerId {
+    uint64_t value;
+};
+
+
+// Scratch memory for the jobs run by one worker, from BasicThreadPool::workerArena()
+// Allocation bumps an offset through chunks that the worker keeps, without a lock or a trip to malloc, and
+// everything a job allocates is released at once when it returns. Destructors are not run, so the arena is for
+// buffers that don't outlive the job. A job can also release what it has allocated since a mark() sooner.
+class WorkerArena {
+public:
+
+    static constexpr size_t MIN_CHUNK_SIZE = 64 * 1024;
+
+
+    // A position in the arena to rewind() to
+    struct Mark {
+        size_t chunk;
+        size_t offset;
+    };
+
+
+    WorkerArena() : m_chunk(0), m_offset(0) { }
+
+
+    WorkerArena(const WorkerArena&) = delete;
+    WorkerArena& operator=(const WorkerArena&) = delete;
+
+
+    // Get size bytes aligned to align (a power of 2), valid until the job returns or the arena is rewound past them
+    void* allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+        for (; m_chunk < m_chunks.size(); ++m_chunk, m_offset = 0) {
+            void* ptr = allocateFrom(m_chunks[m_chunk], size, align);
+            if (ptr != nullptr) {
+                return ptr;
+            }
+        }
+
+        size_t chunk_size = MIN_CHUNK_SIZE;
+        if (!m_chunks.empty()) {
+            chunk_size = m_chunks.back().size * 2;
+        }
+        while (chunk_size < size + align) {
+            chunk_size *= 2;
+        }
+        m_chunks.push_back(Chunk{std::unique_ptr<unsigned char[]>(new unsigned char[chunk_size]), chunk_size});
+        m_chunk = m_chunks.size() - 1;
+        m_offset = 0;
+        return allocateFrom(m_chunks.back(), size, align);
+    }
+
+
+    // Get uninitialised storage for count objects of type T
+    template<typename T>
+    T* allocateArray(size_t count) {
+        return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+    }
+
+
+    Mark mark() const noexcept {
+        return Mark{m_chunk, m_offset};
+    }
+
+
+    // Release everything allocated since mark was taken
+    void rewind(Mark mark) noexcept {
+        m_chunk = mark.chunk;
+        m_offset = mark.offset;
+    }
+
+
+    // Get the number of bytes held in chunks by the arena, used or not
+    size_t capacity() const noexcept {
+        size_t bytes = 0;
+        for (const Chunk& chunk : m_chunks) {
+            bytes += chunk.size;
+        }
+        return bytes;
+    }
+
+private:
+
+    struct Chunk {
+        std::unique_ptr<unsigned char[]> data;
+        size_t size;
+    };
+
+
+    void* allocateFrom(Chunk& chunk, size_t size, size_t align) noexcept {
+        uintptr_t base = reinterpret_cast<uintptr_t>(chunk.data.get());
+        uintptr_t start = (base + m_offset + (align - 1)) & ~static_cast<uintptr_t>(align - 1);
+        if (start + size > base + chunk.size) {
+            return nullptr;
+        }
+        m_offset = (start + size) - base;
+        return reinterpret_cast<void*>(start);
+    }
+
+
+    std::vector<Chunk> m_chunks;
+    size_t m_chunk;     // the chunk being allocated from, and how far into it
+    size_t m_offset;
+};
+
+
+// Standard allocator interface over a WorkerArena, for containers used as scratch space by a job
+// Deallocation does nothing, the memory is released along with the rest of the job's allocations.
+template<typename T>
+class ArenaAllocator {
+public:
+
+    using value_type = T;
+
+
+    explicit ArenaAllocator(WorkerArena& arena) noexcept : m_arena(&arena) { }
+
+
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept : m_arena(other.m_arena) { }
+
+
+    T* allocate(size_t n) {
+        return m_arena->allocateArray<T>(n);
+    }
+
+
+    void deallocate(T*, size_t) noexcept { }
+
+
+    template<typename U>
+    bool operator==(const ArenaAllocator<U>& other) const noexcept {
+        return (m_arena == other.m_arena);
+    }
+
+
+    template<typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const noexcept {
+        return (m_arena != other.m_arena);
+    }
+
+private:
+
+    template<typename U> friend class ArenaAllocator;
+
+    WorkerArena* m_arena;
+};
+
+
+template<typename QueuePolicy, typename IdlePolicy = AdaptiveIdle, typename MetricsPolicy = CountMetrics>
+class BasicThreadPool;
+
+
+namespace tp_detail {
+
+// The arena of the worker running on the calling thread, of whichever thread pool, or nullptr
+inline WorkerArena*& currentArena() {
+    static thread_local WorkerArena* arena = nullptr;
+    return arena;
+}
+
+// The flag behind a CancellationSource or CancellationToken, and the jobs added with them
+struct CancelState {
+    CancelState() : cancelled(false) { }
+
+    explicit CancelState(std::shared_ptr<CancelState> parent_state) : cancelled(false), parent(std::move(parent_state)) { }
+
+    bool isCancelled() const {
+        return cancelled.load(std::memory_order_acquire) || (parent && parent->isCancelled());
+    }
+
+    std::atomic<bool> cancelled;
+    const std::shared_ptr<CancelState> parent;     // the source a single job's state was made from
+};
+
+}   // namespace tp_detail
+
+
+// A handle to cancel a job before it starts, as returned by BasicThreadPool::addJob(const CancellationSource&,
+// work_func), or to check whether a CancellationSource has been cancelled. Tokens are cheap to copy, and can be used
+// from any thread, even after the job has run or the pool has gone.
+class CancellationToken {
+public:
+
+    CancellationToken() { }
+
+
+    // Mark the job as dead, so that it is destroyed without being run when a worker comes to it
+    // A job that has already started is left to finish, and can check isCancelled() to give up early.
+    void cancel() {
+        if (m_state) {
+            m_state->cancelled.store(true, std::memory_order_release);
+        }
+    }
+
+
+    bool isCancelled() const {
+        return (m_state && m_state->isCancelled());
+    }
+
+private:
+
+    template<typename QueuePolicy, typename IdlePolicy, typename MetricsPolicy>
+    friend class BasicThreadPool;
+
+    friend class CancellationSource;
+
+
+    explicit CancellationToken(std::shared_ptr<tp_detail::CancelState> state) : m_state(std::move(state)) { }
+
+
+    std::shared_ptr<tp_detail::CancelState> m_state;
+};
+
+
+// Cancels every job added with it at once, eg all of one client's queued jobs when it disconnects, see
+// BasicThreadPool::addJob(const CancellationSource&, work_func). Jobs added once the source has been cancelled are
+// dead from the start. Copies of a source share the same state.
+class CancellationSource {
+public:
+
+    CancellationSource() : m_state(std::make_shared<tp_detail::CancelState>()) { }
+
+
+    void cancel() {
+        m_state->cancelled.store(true, std::memory_order_release);
+    }
+
+
+    bool isCancelled() const {
+        return m_state->isCancelled();
+    }
+
+
+    // Get a token for the whole source, eg for running jobs to check whether they should give up
+    CancellationToken token() const {
+        return CancellationToken(m_state);
+    }
+
+private:
+
+    template<typename QueuePolicy, typename IdlePolicy, typename MetricsPolicy>
+    friend class BasicThreadPool;
+
+
+    std::shared_ptr<tp_detail::CancelState> m_state;
+};
+
+
+// A set of jobs that can be waited for on their own, while other jobs carry on running, eg:
+//     TaskGroup group;
+//     pool.addJob(group, work_func_1);
+//     pool.addJob(group, work_func_2);
+//     group.wait();
+// Jobs are added with BasicThreadPool::addJob(TaskGroup&, work_func), and a group should only be used with one pool
+// at a time. If a job throws, the first exception is rethrown by wait(). The destructor waits as well (without
+// rethrowing anything), so a group's jobs never outlive it.
+class TaskGroup {
+public:
+
+    TaskGroup() : m_pending(0), m_pool(nullptr), m_help(nullptr) { }
+
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+
+    ~TaskGroup() {
+        waitForJobs();
+    }
+
+
+    // Block until every job in the group has completed, or been cleared from the queue
+    // Rather than sleeping, the calling thread runs jobs from the pool's queue (from this group or not) until the
+    // group is done. A worker waiting inside a job keeps helping for as long as it takes, so nested groups can't
+    // deadlock, while any other thread sleeps once there is nothing on the queue for it to run.
+    // Once every job is done, the first exception thrown by any of them (since the last wait()) is rethrown.
+    void wait() {
+        std::exception_ptr error = waitForJobs();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+
+    // Get the count of the group's queued and running jobs
+    size_t pendingJobs() const {
+        return m_pending;
+    }
+
+private:
+
+    template<typename QueuePolicy, typename IdlePolicy, typename MetricsPolicy>
+    friend class BasicThreadPool;
+
+
+    // Wait for the group's jobs to be done, and take the first exception if any of them threw
+    std::exception_ptr waitForJobs() {
+        void* pool = m_pool;
+        if (pool != nullptr) {
+            m_help.load()(pool, *this);
+        }
+        // the last job to finish holds the lock as it notifies us, so once we have had it the group is free to go
+        std::lock_guard<std::mutex> g_lk(m_mutex);
+        std::exception_ptr error = m_error;
+        m_error = nullptr;
+        return error;
+    }
+
+
+    void jobAdded() {
+        ++m_pending;
+    }
+
+
+    void jobFailed(std::exception_ptr error) {
+        std::lock_guard<std::mutex> g_lk(m_mutex);
+        if (!m_error) {
+            m_error = error;
+        }
+    }
+
+
+    // Count a job as done, taking the lock only if it could be the last one
+    void jobDone() {
+        size_t pending = m_pending;
+        while (pending > 1) {
+            if (m_pending.compare_exchange_weak(pending, pending - 1)) {
+                return;
+            }
+        }
+        std::lock_guard<std::mutex> g_lk(m_mutex);
+        if (--m_pending == 0) {
+            m_done_cv.notify_all();
+        }
+    }
+
+
+    void sleepUntilDone() {
+        std::unique_lock<std::mutex> g_lk(m_mutex);
+        m_done_cv.wait(g_lk, [this](){ return (m_pending == 0); });
+    }
+
+
+    std::atomic<size_t> m_pending;
+    std::atomic<void*> m_pool;                          // the pool the group's jobs were added to...
+    std::atomic<void (*)(void*, TaskGroup&)> m_help;    // ...and how to help it run them while waiting
+    std::mutex m_mutex;
+    std::condition_variable m_done_cv;
+    std::exception_ptr m_error;                         // guarded by m_mutex
+};
+
+
+// A graph of jobs that can be run on a pool again and again, each job starting as soon as the jobs it depends on
+// have finished, eg:
+//     TaskGraph graph;
+//     TaskGraph::Node decode = graph.addNode(decode_func);
+//     TaskGraph::Node transform_1 = graph.addNode(transform_func_1, {decode});
+//     TaskGraph::Node transform_2 = graph.addNode(transform_func_2, {decode});
+//     graph.addNode(merge_func, {transform_1, transform_2});
+//     graph.run(pool);
+//     graph.wait();
+// Each node counts down its unfinished dependencies with an atomic counter, and the node that takes a count to zero
+// starts the dependent node itself: running it straight after its own job if it is the last one it starts, or
+// adding it to the pool otherwise. Nothing is allocated to run a graph once it is built, so repeat runs cost little
+// more than their jobs. The graph must not have cycles, or be changed while it is running.
+// If a node throws, the nodes that depend on it are skipped for that run, and the exception is rethrown by wait()
+// (or by the next run(), if the run wasn't waited for).
+class TaskGraph {
+public:
+
+    // Handle to a node of a graph
+    struct Node {
+        size_t index;
+    };
+
+
+    TaskGraph() { }
+
+
+    TaskGraph(const TaskGraph&) = delete;
+    TaskGraph& operator=(const TaskGraph&) = delete;
+
+
+    // Add a node that runs work_func, after each of dependencies have finished
+    // work_func can be any void() callable, and is called once per run of the graph.
+    template<typename F>
+    Node addNode(F&& work_func, std::initializer_list<Node> dependencies = {}) {
+        m_nodes.emplace_back(std::make_unique<NodeState>(std::forward<F>(work_func)));
+        Node node = {m_nodes.size() - 1};
+        for (Node dependency : dependencies) {
+            addDependency(dependency, node);
+        }
+        return node;
+    }
+
+
+    // Make node wait for dependency to finish before it starts
+    void addDependency(Node dependency, Node node) {
+        m_nodes[dependency.index]->dependents.push_back(node.index);
+        ++m_nodes[node.index]->dependency_count;
+    }
+
+
+    // Start running the graph on a pool, without waiting for it to finish
+    // If the graph is still running from the last call, this waits for it first.
+    template<typename Pool>
+    void run(Pool& pool) {
+        m_group.wait();
+        for (const auto& node : m_nodes) {
+            node->unfinished_dependencies.store(node->dependency_count, std::memory_order_relaxed);
+        }
+        for (size_t index = 0; index < m_nodes.size(); ++index) {
+            if (m_nodes[index]->dependency_count == 0) {
+                startNode(pool, index);
+            }
+        }
+    }
+
+
+    // Block until the current run of the graph has finished, helping the pool run jobs meanwhile, see TaskGroup
+    void wait() {
+        m_group.wait();
+    }
+
+
+    // Get the number of nodes in the graph
+    size_t size() const {
+        return m_nodes.size();
+    }
+
+private:
+
+    struct NodeState {
+        template<typename F>
+        NodeState(F&& work_func) : work(std::forward<F>(work_func)), dependency_count(0), unfinished_dependencies(0) { }
+
+        Job work;
+        std::vector<size_t> dependents;
+        size_t dependency_count;
+        std::atomic<size_t> unfinished_dependencies;    // counted down by dependencies over a run
+    };
+
+
+    template<typename Pool>
+    void startNode(Pool& pool, size_t index) {
+        pool.addJob(m_group, [this, &pool, index](){ runNodes(pool, index); });
+    }
+
+
+    // Run a node, then each node it was the last dependency of, carrying on with one of them here
+    template<typename Pool>
+    void runNodes(Pool& pool, size_t index) {
+        while (true) {
+            NodeState& node = *m_nodes[index];
+            node.work();
+
+            size_t next = NO_NODE;
+            for (size_t dependent : node.dependents) {
+                if (--m_nodes[dependent]->unfinished_dependencies == 0) {
+                    if (next != NO_NODE) {
+                        startNode(pool, next);
+                    }
+                    next = dependent;
+                }
+            }
+            if (next == NO_NODE) {
+                return;
+            }
+            index = next;
+        }
+    }
+
+
+    static constexpr size_t NO_NODE = static_cast<size_t>(-1);
+
+
+    std::vector<std::unique_ptr<NodeState>> m_nodes;
+    TaskGroup m_group;          // destroyed first, so that it can wait for a run to finish before the nodes go
+};
+
+
+#ifdef __cpp_impl_coroutine
+
+template<typename T = void>
+class Task;
+
+
+namespace tp_detail {
+
+struct TaskPromiseBase;
+
+
+// The coroutine whose resume job the calling thread is queueing, see BasicThreadPool::ScheduleAwaiter
+struct QueuingCoroutine {
+    std::coroutine_handle<> handle;
+    bool discarded;     // its job was destroyed without being queued
+};
+
+
+inline QueuingCoroutine& queuingCoroutine() noexcept {
+    static thread_local QueuingCoroutine queuing{nullptr, false};
+    return queuing;
+}
+
+
+// Job that resumes a suspended coroutine, small enough to be stored inline in the Job
+// If the job is destroyed without being run, it destroys the spawn()ed coroutine that owns the suspended one (see
+// spawnedCoroutine()), so that the chain is freed and the spawn()ed task's future reports a broken promise rather
+// than them being leaked. A coroutine with any other owner is left suspended, for its owner to destroy. While the
+// job is being queued, what happens to the coroutine is left to the awaiter instead, which knows whether the job
+// was refused or the queue threw.
+class ResumeCoroutine {
+public:
+    ResumeCoroutine(std::coroutine_handle<> handle, std::coroutine_handle<> owner) noexcept :
+        m_handle(handle),
+        m_owner(owner)
+    { }
+
+    ResumeCoroutine(ResumeCoroutine&& other) noexcept :
+        m_handle(std::exchange(other.m_handle, nullptr)),
+        m_owner(std::exchange(other.m_owner, nullptr))
+    { }
+
+    ResumeCoroutine(const ResumeCoroutine&) = delete;
+
+    ~ResumeCoroutine() {
+        if (!m_handle) {
+            return;
+        }
+        QueuingCoroutine& queuing = queuingCoroutine();
+        if (queuing.handle == m_handle) {
+            queuing.discarded = true;
+        } else if (m_owner) {
+            m_owner.destroy();
+        }
+    }
+
+    void operator()() {
+        std::exchange(m_handle, nullptr).resume();
+    }
+
+private:
+    std::coroutine_handle<> m_handle;
+    std::coroutine_handle<> m_owner;    // the spawn()ed coroutine that owns m_handle's, if there is one
+};
+
+
+// Suspends a finished Task, and resumes whoever co_awaited it straight away on the same thread
+struct TaskFinalAwaiter {
+    bool await_ready() noexcept {
+        return false;
+    }
+
+    template<typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+        std::coroutine_handle<> continuation = handle.promise().continuation;
+        return continuation ? continuation : std::noop_coroutine();
+    }
+
+    void await_resume() noexcept { }
+};
+
+
+struct TaskPromiseBase {
+    std::suspend_always initial_suspend() noexcept {
+        return {};
+    }
+
+    TaskFinalAwaiter final_suspend() noexcept {
+        return {};
+    }
+
+    void unhandled_exception() noexcept {
+        error = std::current_exception();
+    }
+
+    std::coroutine_handle<> continuation;
+    std::coroutine_handle<> spawned;        // see spawnedCoroutine(), set as the task is awaited
+    std::exception_ptr error;
+};
+
+
+template<typename T>
+struct TaskPromise : TaskPromiseBase {
+    Task<T> get_return_object() noexcept;
+
+    template<typename U>
+    void return_value(U&& value) {
+        result.emplace(std::forward<U>(value));
+    }
+
+    T takeResult() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return std::move(*result);
+    }
+
+    std::optional<T> result;
+};
+
+
+template<>
+struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object() noexcept;
+
+    void return_void() noexcept { }
+
+    void takeResult() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+
+// A coroutine that starts straight away and frees itself when it finishes, for BasicThreadPool::spawn()
+// Its frames are the only ones the pool destroys, when their resume job is discarded (see ResumeCoroutine).
+struct DetachedCoroutine {
+    struct promise_type {
+        DetachedCoroutine get_return_object() noexcept {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() noexcept { }
+
+        void unhandled_exception() noexcept {
+            std::terminate();
+        }
+    };
+};
+
+
+// The spawn()ed coroutine that owns the one handle is for, either itself or through a chain of co_awaited Tasks
+// Returns a null handle for coroutines owned by anything else.
+template<typename Promise>
+std::coroutine_handle<> spawnedCoroutine(std::coroutine_handle<Promise> handle) noexcept {
+    if constexpr (std::is_same<Promise, DetachedCoroutine::promise_type>::value) {
+        return handle;
+    } else if constexpr (std::is_base_of<TaskPromiseBase, Promise>::value) {
+        return handle.promise().spawned;
+    } else {
+        return nullptr;
+    }
+}
+
+}   // namespace tp_detail
+
+
+// A coroutine that produces a T (or nothing, for Task<void>), eg:
+//     Task<int> answer(ThreadPool& pool) {
+//         co_await pool.schedule();   // carry on on one of the pool's workers
+//         co_return 42;
+//     }
+// A Task doesn't start until it is co_awaited, and when it finishes the awaiting coroutine is resumed right away on
+// the same thread, rather than queued again. If the task throws, the exception is rethrown from co_await. To start a
+// task from outside of a coroutine, see BasicThreadPool::spawn(). Only available when compiled as C++20 or later.
+template<typename T>
+class Task {
+public:
+
+    using promise_type = tp_detail::TaskPromise<T>;
+
+
+    Task(Task&& other) noexcept : m_handle(other.m_handle) {
+        other.m_handle = nullptr;
+    }
+
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (m_handle) {
+                m_handle.destroy();
+            }
+            m_handle = other.m_handle;
+            other.m_handle = nullptr;
+        }
+        return *this;
+    }
+
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+
+    ~Task() {
+        if (m_handle) {
+            m_handle.destroy();
+        }
+    }
+
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+
+    // Start the task, with the awaiting coroutine to be resumed once it is done
+    template<typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> awaiting) noexcept {
+        m_handle.promise().continuation = awaiting;
+        m_handle.promise().spawned = tp_detail::spawnedCoroutine(awaiting);
+        return m_handle;
+    }
+
+
+    T await_resume() {
+        return m_handle.promise().takeResult();
+    }
+
+private:
+
+    friend promise_type;
+
+
+    explicit Task(std::coroutine_handle<promise_type> handle) noexcept : m_handle(handle) { }
+
+
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+
+namespace tp_detail {
+
+template<typename T>
+Task<T> TaskPromise<T>::get_return_object() noexcept {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+}   // namespace tp_detail
+
+#endif
+
+
+// A thread pool class that manages worker threads that run arbitrary callables
+// QueuePolicy is the queue that jobs added from outside of the pool's own jobs wait on: UnboundedQueue (as used by
+// ThreadPool), BoundedMpmcQueue<Capacity>, or any other type with the same members. IdlePolicy is how idle workers
+// wait before sleeping (AdaptiveIdle, FixedIdle<SpinCount, YieldCount> or SleepingIdle), and MetricsPolicy is
+// whether they keep metrics (CountMetrics or NoMetrics). Each is chosen when the pool is compiled rather than
+// checked as it runs, so that a pool only pays for the modes it uses.
+template<typename QueuePolicy, typename IdlePolicy, typename MetricsPolicy>
+class BasicThreadPool {
+public:
+
+    // Constructor
+    // Set work_stealing = true to give each worker its own job deque. Jobs added from inside a running job go
+    // to the local deque of the worker running it, and idle workers steal from the other end of busy workers'
+    // deques, so that most job fetches never touch the shared queue lock. Job execution order is not FIFO.
+    // idle_strategy sets how workers wait for jobs when there are none, see IdleStrategy.
+    BasicThreadPool(bool auto_start, size_t worker_count = 0, bool work_stealing = false, IdleStrategy idle_strategy = IdleStrategy()) :  // If worker_count == 0, = number of hardware threads
+        m_stopped(true),
+        m_waiters(0),
+        m_draining(false),
+        m_refused_jobs(0),
+        m_work_stealing(work_stealing),
+        m_idle_strategy(idle_strategy),
+        m_timers(this, &BasicThreadPool::submitTimerJobs),
+        m_key_shards(nullptr),
+        m_key_queued(0),
+        m_ready_shard_count(0),
+        m_partition_table(nullptr),
+        m_partition_count(0),
+        m_worker_slots(0),
+        m_worker_capacity(0),
+        m_worker_table(nullptr),
+        m_worker_count(0),
+        m_max_workers(0),
+        m_scaling_queue_depth(0),
+        m_queued_jobs(0),
+        m_deque_jobs(0),
+        m_idle_workers(0),
+        m_idle_stack(0),
+        m_dequeue_batch(MAX_QUEUE_SHARE),
+        m_queue_capacity(0),
+        m_space_watermark(0),
+        m_space_waiters(0),
+        m_pending_jobs(0),
+        m_state_slab(std::make_shared<tp_detail::StateSlab>()),
+        m_job_errors(0),
+        m_cancelled_jobs(0)
+    {
+        for (size_t node = 0; node < tp_detail::numaNodeCpus().size(); ++node) {
+            m_node_queues.emplace_back(std::make_unique<CountedQueue>());
+        }
+        if (auto_start) {
+            start(worker_count);
+        }
+    }
+
+
+    // Copy Constructor (deleted)
+    BasicThreadPool(const BasicThreadPool&) = delete;
+
+
+    // Destructor
+    ~BasicThreadPool() {
+        m_timers.shutdown();
+        stop();
+    }
+
+
+    // Add a new job to the queue
+    // work_func can be any void() callable, including move-only ones. It is moved (or copied, if passed as an
+    // lvalue) into a Job, which only allocates if the callable is larger than Job::INLINE_SIZE. If the queue is at
+    // capacity (see setQueueCapacity()) this blocks until there is room, as does every other way of adding jobs.
+    // Jobs added by the pool's own jobs never wait, and are run there and then if a bounded queue policy is full.
+    template<typename F>
+    void addJob(F&& work_func) {
+        Job job(std::forward<F>(work_func));
+
+        Worker* local_worker = localWorker();
+        if (local_worker != nullptr) {
+            addLocalJobs(*local_worker, &job, 1);
+            return;
+        }
+
+        ++m_pending_jobs;
+        pushQueuedJobs(lane(Priority::Normal), &job, 1);
+    }
+
+
+    // Add a new job to the queue if there is room for it, returning false if it is at capacity (or the queue policy is
+    // full), or the pool is draining and refuses it. work_func is only moved from (or copied) if there is room below
+    // the capacity, so a full bounded queue policy may still have taken and destroyed it. Jobs added from the pool's
+    // own jobs are always added.
+    template<typename F>
+    bool tryAddJob(F&& work_func) {
+        return addJobBy(std::forward<F>(work_func), nullptr);
+    }
+
+
+    // Add a new job to the queue, waiting up to timeout for room if it is at capacity (or the queue policy is full)
+    // Returns false if there was no room by then, or the pool is draining, see tryAddJob().
+    template<typename Rep, typename Period, typename F>
+    bool addJobFor(std::chrono::duration<Rep, Period> timeout, F&& work_func) {
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+        return addJobBy(std::forward<F>(work_func), &deadline);
+    }
+
+
+    // Add a new job to the queue with a priority other than Priority::Normal
+    template<typename F>
+    void addJob(F&& work_func, Priority priority) {
+        Job job(std::forward<F>(work_func));
+        ++m_pending_jobs;
+        pushQueuedJobs(lane(priority), &job, 1);
+    }
+    
+
+    // Add a new job to the queue of a NUMA node
+    // Workers placed on that node (see WorkerPlacement) take jobs from it before anything else, other than jobs on
+    // their own deque when work stealing. Other workers only take them once the main queue is empty, so the job
+    // still runs if no worker is on the node. Node indexes beyond numaNodeCount() wrap around.
+    template<typename F>
+    void addJob(F&& work_func, NumaNode node) {
+        Job job(std::forward<F>(work_func));
+        ++m_pending_jobs;
+        pushQueuedJobs(*m_node_queues[node.index % m_node_queues.size()], &job, 1);
+    }
+
+
+    // Add a new job to the queue as part of a task group, see TaskGroup
+    template<typename F>
+    void addJob(TaskGroup& group, F&& work_func) {
+        group.m_help = &BasicThreadPool::helpTaskGroup;
+        group.m_pool = this;
+        addJob(GroupJob<typename std::decay<F>::type>(group, std::forward<F>(work_func)));
+    }
+
+
+    // Add a new job to run after every other job added with the same key, and on the same worker where it can
+    // Jobs for a key run one at a time in the order they were added, so they can share state without a lock. Keys
+    // are hashed into 256 shards, each of which runs its jobs in turn, and a shard with jobs waiting is handed to the
+    // same worker each time so that its state stays in that worker's cache. Only if that worker already has 4 shards
+    // waiting for it (or isn't running) can any worker take the shard instead. Keyed jobs are counted by
+    // queuedJobs() but not held to the queue capacity. As with other jobs, those from outside of the pool are refused
+    // while it is draining.
+    template<typename F>
+    void addJob(AffinityKey key, F&& work_func) {
+        KeyShard& shard = keyShard(key);
+        Job job(KeyedJob<typename std::decay<F>::type>(*this, shard, std::forward<F>(work_func)));
+        if (m_draining && (workerContext().pool != this)) {
+            ++m_refused_jobs;           // the job is destroyed unrun, as in pushQueuedJobs()
+            return;
+        }
+        ++m_pending_jobs;
+        ++m_key_queued;
+        stampQueuedJobs(&job, 1);
+
+        bool schedule = false;
+        {
+            std::lock_guard<std::mutex> k_lk(shard.mutex);
+            shard.jobs.pushBack(std::move(job));
+            if (shard.state == ShardState::Idle) {
+                shard.state = ShardState::Ready;
+                schedule = true;
+            }
+        }
+        if (schedule) {
+            scheduleShard(shard);
+        }
+    }
+
+
+    // A queue of its own for a subsystem, served by the pool's workers in proportion to its weight, see addPartition()
+    class Partition;
+
+
+    // Add a partition to the pool, so that several subsystems can share one set of workers rather than each
+    // starting a pool with a thread per core
+    // Workers take turns between the pool's own queues (with a weight of 1) and each partition with jobs waiting,
+    // taking up to weight jobs from each in turn, so that when they are all busy each gets a share of the workers in
+    // proportion to its weight, while idle partitions' shares go to the rest. Partitions last as long as the pool.
+    Partition& addPartition(size_t weight = 1) {
+        std::lock_guard<std::mutex> m_lk(m_management_mutex);
+        m_partition_storage.emplace_back(new Partition(*this, std::max<size_t>(weight, 1)));
+        Partition& partition = *m_partition_storage.back();
+        partition.m_group.m_help = &BasicThreadPool::helpTaskGroup;
+        partition.m_group.m_pool = this;
+
+        // workers read the table without a lock, so it is replaced rather than changed, and old ones are kept
+        size_t count = m_partition_storage.size();
+        std::unique_ptr<Partition*[]> table(new Partition*[count]);
+        for (size_t i = 0; i < count; ++i) {
+            table[i] = m_partition_storage[i].get();
+        }
+        m_partition_table.store(table.get(), std::memory_order_release);
+        m_partition_tables.push_back(std::move(table));
+        m_partition_count.store(count, std::memory_order_release);
+        return partition;
+    }
+
+
+    // Add a new job to the queue that can be cancelled until it starts
+    // The job is dead once source is cancelled, or the token returned (which covers this job alone) is. Workers
+    // destroy dead jobs without running them as they come to them, counting them in cancelledJobs(), so a dead job
+    // doesn't hold up the queue but is still pending until then. Cancelling is O(1) however many jobs it covers.
+    template<typename F>
+    CancellationToken addJob(const CancellationSource& source, F&& work_func) {
+        std::shared_ptr<tp_detail::CancelState> state = std::allocate_shared<tp_detail::CancelState>(
+            tp_detail::SlabAllocator<tp_detail::CancelState>(m_state_slab), source.m_state);
+        addJob(CancellableJob<typename std::decay<F>::type>(*this, state, std::forward<F>(work_func)));
+        return CancellationToken(std::move(state));
+    }
+
+
+    // Add a job to the queue once delay has passed
+    // Timers are kept on a hierarchical timer wheel with a resolution of 1ms, by a timer thread that the pool
+    // starts the first time it is needed. It moves each job to the queue as it falls due, so timers never hold up a
+    // worker, and adding or cancelling one is O(1) however many there are. A job isn't pending (so wait() doesn't
+    // wait for it) until it has been queued. Returns an id for cancelTimer().
+    template<typename Rep, typename Period, typename F>
+    TimerId addJobAfter(std::chrono::duration<Rep, Period> delay, F&& work_func) {
+        return {m_timers.add(Job(std::forward<F>(work_func)), std::chrono::duration_cast<std::chrono::nanoseconds>(delay), std::chrono::nanoseconds(0))};
+    }
+
+
+    // Add a job to the queue every period, starting a period from now, until it is cancelled with cancelTimer()
+    // Each run is queued a period (of at least 1ms) after the last one was due, skipping any that were missed while
+    // it ran, and never before the last run has finished, so that runs of the job don't overlap.
+    template<typename Rep, typename Period, typename F>
+    TimerId addJobEvery(std::chrono::duration<Rep, Period> period, F&& work_func) {
+        std::chrono::nanoseconds period_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(period);
+        return {m_timers.add(Job(std::forward<F>(work_func)), period_ns, period_ns)};
+    }
+
+
+    // Cancel a job added with addJobAfter() or addJobEvery()
+    // Returns false if the job has already been queued, or the timer was already cancelled. A periodic job that is
+    // queued or running when it is cancelled finishes that run.
+    bool cancelTimer(TimerId timer) {
+        return m_timers.cancel(timer.value);
+    }
+
+
+    // Get the number of timers that haven't been cancelled or fallen due for the last time
+    size_t pendingTimers() {
+        return m_timers.size();
+    }
+
+
+    // Add a batch of jobs to the queue, from an iterator range of callables
+    // The whole batch is queued under a single queue lock acquisition (none at all with a lock-free queue), and
+    // min(batch size, idle workers) workers are woken.
+    template<typename InputIt>
+    void addJobs(InputIt first, InputIt last) {
+        std::vector<Job> jobs;
+        jobs.reserve(batchSize(first, last, typename std::iterator_traits<InputIt>::iterator_category()));
+        for (; first != last; ++first) {
+            jobs.emplace_back(*first);
+        }
+        addJobs(std::move(jobs));
+    }
+
+
+    // Add a batch of jobs to the queue, from a container of callables (moved from if passed as an rvalue)
+    // The callables of a container passed as an lvalue are copied, so a container of move-only callables, such as a
+    // std::vector<Job>, must be passed as an rvalue, e.g. addJobs(std::move(jobs)).
+    template<typename Container>
+    void addJobs(Container&& work_funcs) {
+        addContainerJobs(work_funcs, std::is_lvalue_reference<Container>());
+    }
+
+
+    void addJobs(std::vector<Job>&& jobs) {
+        if (jobs.empty()) {
+            return;
+        }
+
+        Worker* local_worker = localWorker();
+        if (local_worker != nullptr) {
+            addLocalJobs(*local_worker, jobs.data(), jobs.size());
+            return;
+        }
+
+        m_pending_jobs += jobs.size();
+        pushQueuedJobs(lane(Priority::Normal), jobs.data(), jobs.size());
+    }
+
+
+    // Add a new job to the queue that calls func(args...), and get a future for its result
+    // func and args are moved (or copied) into the job, as with std::async(). If the job throws, the exception is
+    // rethrown from future::get(), and if the job is cleared from the queue the future reports a broken promise.
+    // The future's shared state is allocated from a slab owned by the pool and recycled as futures are released.
+    template<typename F, typename... Args>
+    std::future<decltype(std::declval<typename std::decay<F>::type&>()(std::declval<typename std::decay<Args>::type>()...))>
+    submit(F&& func, Args&&... args) {
+        using Result = decltype(std::declval<typename std::decay<F>::type&>()(std::declval<typename std::decay<Args>::type>()...));
+
+        std::promise<Result> promise(std::allocator_arg, tp_detail::SlabAllocator<unsigned char>(m_state_slab));
+        std::future<Result> future = promise.get_future();
+        addJob(tp_detail::SubmittedJob<Result, typename std::decay<F>::type, typename std::decay<Args>::type...>(
+            std::move(promise), std::forward<F>(func), std::forward<Args>(args)...));
+        return future;
+    }
+
+
+    // Call body(i) for each i in [begin, end) on the worker threads, blocking until every call has returned
+    // The range is split in half on demand, whenever there is an idle worker to take the other half, down to chunks
+    // of grain indices. A busy pool therefore runs the loop as a few large jobs, while idle workers keep taking work
+    // from any chunk that takes longer than the others. grain = 0 picks a grain from the range size.
+    // If body throws, the remaining chunks are skipped and the first exception is rethrown here once the rest have
+    // stopped. If a chunk is cleared from the queue (or refused while draining) the loop fails in the same way, with
+    // a broken promise std::future_error as from submit(). If called from inside a job the calling worker helps run
+    // queued jobs until the loop is done, and if the pool is stopped the loop runs on the calling thread.
+    template<typename Index, typename Body>
+    void parallelFor(Index begin, Index end, Body body, size_t grain = 0) {
+        auto loop_body = [&body](Index i){ body(i); return tp_detail::NoResult(); };
+        auto combine = [](tp_detail::NoResult, tp_detail::NoResult){ return tp_detail::NoResult(); };
+        runParallelLoop(begin, end, tp_detail::NoResult(), loop_body, combine, grain);
+    }
+
+
+    // Reduce combine(... combine(identity, body(i)) ...) over each i in [begin, end) on the worker threads, blocking
+    // until the result is ready. combine must be associative and commutative, as partial results are combined in
+    // whichever order the chunks finish.
+    // The range is split and run as for parallelFor().
+    template<typename Index, typename T, typename Body, typename Combine>
+    T parallelReduce(Index begin, Index end, T identity, Body body, Combine combine, size_t grain = 0) {
+        return runParallelLoop(begin, end, identity, body, combine, grain);
+    }
+
+
+#ifdef __cpp_impl_coroutine
+
+    // Awaitable returned by schedule()
+    class ScheduleAwaiter {
+    public:
+        explicit ScheduleAwaiter(BasicThreadPool& pool) : m_pool(pool) { }
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        // If the job is refused, a spawn()ed coroutine is destroyed here and any other is left suspended. If queueing
+        // it throws, the exception is rethrown into the coroutine by co_await.
+        template<typename Promise>
+        void await_suspend(std::coroutine_handle<Promise> handle) {
+            std::coroutine_handle<> spawned = tp_detail::spawnedCoroutine(handle);
+            tp_detail::QueuingCoroutine& queuing = tp_detail::queuingCoroutine();
+            tp_detail::QueuingCoroutine outer = queuing;    // a worker may run other jobs while queueing, see pushJobs()
+            queuing = tp_detail::QueuingCoroutine{handle, false};
+            try {
+                m_pool.addJob(tp_detail::ResumeCoroutine(handle, spawned));
+            } catch (...) {
+                queuing = outer;
+                throw;
+            }
+            bool refused = queuing.discarded;
+            queuing = outer;
+            if (refused && spawned) {
+                spawned.destroy();      // which may be this awaiter's own coroutine, so nothing is touched after
+            }
+        }
+
+        void await_resume() const noexcept { }
+
+    private:
+        BasicThreadPool& m_pool;
+    };
+
+
+    // Get an awaitable that suspends the calling coroutine and resumes it on one of the workers, eg:
+    //     co_await pool.schedule();
+    // The coroutine handle itself is queued as the job, so this doesn't allocate. If the job is cleared from the
+    // queue, or refused while draining, a coroutine started by spawn() (or a Task it awaits) is destroyed without
+    // being resumed, and its future reports a broken promise. Any other coroutine is left suspended, for whatever
+    // owns it to destroy.
+    ScheduleAwaiter schedule() {
+        return ScheduleAwaiter(*this);
+    }
+
+
+    // Start a task on one of the workers, and get a future for its result (or its exception)
+    template<typename T>
+    std::future<T> spawn(Task<T> task) {
+        std::promise<T> promise(std::allocator_arg, tp_detail::SlabAllocator<unsigned char>(m_state_slab));
+        std::future<T> future = promise.get_future();
+        runSpawnedTask(std::move(task), std::move(promise));
+        return future;
+    }
+
+#endif
+
+
+    // Start the threadpool
+    // Set worker_count = 0 to use one thread per hardware supported thread
+    bool start(size_t worker_count) {
+        std::lock_guard<std::mutex> m_lk(m_management_mutex);
+        return startWorkers(worker_count);
+    }
+
+
+    // Start the threadpool with a new idle strategy
+    bool start(size_t worker_count, IdleStrategy idle_strategy) {
+        std::lock_guard<std::mutex> m_lk(m_management_mutex);
+        if (m_stopped) {
+            m_idle_strategy = idle_strategy;
+        }
+        return startWorkers(worker_count);
+    }
+
+
+    // Start the threadpool with workers placed on particular cpus or NUMA nodes
+    // The placement is kept for later calls to start(worker_count).
+    bool start(size_t worker_count, WorkerPlacement placement) {
+        std::lock_guard<std::mutex> m_lk(m_management_mutex);
+        if (m_stopped) {
+            m_placement = std::move(placement);
+        }
+        return startWorkers(worker_count);
+    }
+    
+
+    // Start the threadpool with workers added and retired as the load changes, see WorkerScaling
+    // worker_count is the number of workers to start with, kept between the scaling's min and max workers. The
+    // scaling is kept for later calls to start(worker_count).
+    bool start(size_t worker_count, WorkerScaling scaling) {
+        std::lock_guard<std::mutex> m_lk(m_management_mutex);
+        if (m_stopped) {
+            m_scaling = scaling;
+        }
+        return startWorkers(worker_count);
+    }
+
+
+    // Change the number of running workers, without waiting for anything
+    // New workers start straight away. Surplus workers finish the job they are running and any jobs on their own
+    // deque before their threads exit, and have their threads join()ed by stop() or whenever their slot is reused.
+    // An elastic pool carries on scaling from the new worker count. Set worker_count = 0 to use one thread per
+    // hardware supported thread. Returns false if the pool is stopped.
+    bool resize(size_t worker_count) {
+        std::lock_guard<std::mutex> m_lk(m_management_mutex);
+        if (m_stopped) {
+            return false;
+        }
+        if (worker_count == 0) {
+            worker_count = std::thread::hardware_concurrency();
+        }
+
+        if (worker_count > m_worker_count) {
+            growWorkers(worker_count - m_worker_count);
+        } else if (worker_count < m_worker_count) {
+            for (size_t id = workerSlots(); (id > 0) && (m_worker_count > worker_count); --id) {
+                Worker& worker = workerSlot(id - 1);
+                if (worker.state == SlotState::Running) {
+                    worker.state = SlotState::Retiring;
+                    --m_worker_count;
+                    wakeWorker(worker, false);  // in case it is asleep
+                }
+            }
+        }
+        return true;
+    }
+
+
+    // Stop the threadpool once every pending job has run
+    // While draining, jobs added from outside of the pool's own jobs are refused: destroyed without being run, as if
+    // cleared from the queue. Jobs added by running jobs are still run, so that work in progress can finish. The
+    // workers carry on at full speed until there are no pending jobs left, and are then stopped as with stop().
+    // Timers are cancelled once the pool has stopped, and any that fall due while draining are refused.
+    // Returns the number of jobs refused, or 0 if the pool was already stopped.
+    size_t drain() {
+        if (!startDrain()) {
+            return 0;
+        }
+        wait();
+        return finishDrain();
+    }
+
+
+    // Drain the threadpool, giving up at deadline
+    // If there are still pending jobs at the deadline, the workers are stopped once their running jobs have
+    // finished, and the jobs left on the queue are discarded. Returns the number of jobs refused or discarded.
+    size_t drain(std::chrono::steady_clock::time_point deadline) {
+        if (!startDrain()) {
+            return 0;
+        }
+        {
+            std::unique_lock<std::mutex> m_lk(m_management_mutex);
+            ++m_waiters;
+            m_counter_cv.wait_until(m_lk, deadline, [this](){ return (m_pending_jobs == 0); });
+            --m_waiters;
+        }
+        return finishDrain();
+    }
+
+
+    // Stop the threadpool
+    // Call to stop() will block until all running jobs have finished and been join()ed, set clear_queue = false
+    // to leave pending jobs on the queue (to run when the pool is next started) or clear_queue = true to delete
+    // pending jobs and cancel all timers. To run them before stopping, see drain(). Timers that aren't cancelled
+    // carry on queueing their jobs while the pool is stopped.
+    bool stop(bool clear_queue = true) {
+        {
+            std::lock_guard<std::mutex> m_lk(m_management_mutex);
+
+            if (m_stopped) {
+                return false;
+            } else {
+                m_stopped = true;
+                m_max_workers = 0;          // no more scaling up
+            }
+            for (size_t id = 0; id < workerSlots(); ++id) {
+                wakeWorker(workerSlot(id), false);  // wake any sleeping worker threads
+            }
+        }
+        // join all delete all worker threads, including those of retired workers. No slots are added while we are
+        // stopped, so we can look at them without the lock.
+        for (size_t id = 0; id < workerSlots(); ++id) {
+            Worker& worker = workerSlot(id);
+            if (worker.thread) {
+                worker.thread->join();
+                worker.thread.reset();
+            }
+            worker.state = SlotState::Stopped;
+        }
+        m_worker_count = 0;
+
+        if (clear_queue) {
+            m_timers.cancelAll();
+            clearQueue();
+        }
+        
+        return true;
+    }
+    
+
+    // Check if worker threads are running, without taking a lock
+    bool isStopped() {
+        return m_stopped;
+    }
+
+
+    // Get the number of running workers, which changes with resize() and in an elastic pool
+    size_t workerCount() {
+        return m_worker_count;
+    }
+
+
+    // Get the number of NUMA nodes that NumaNode indexes refer to
+    size_t numaNodeCount() {
+        return m_node_queues.size();
+    }
+
+
+    // Get the scratch arena of the worker running the calling job, or nullptr if the caller isn't on a worker
+    // This is any thread pool's worker, so a job helping out with another pool's jobs shares its arena with them.
+    // Everything allocated from the arena by a job is released when the job returns. See WorkerArena.
+    static WorkerArena* workerArena() {
+        return tp_detail::currentArena();
+    }
+
+
+    // Get the index of the worker running the calling thread, or -1 if the caller isn't one of this pool's workers
+    // A starting worker takes the lowest index not in use, so indexes stay below the most workers that the pool has
+    // had running at once, and can be used to look up per-worker state. See WorkerLocal.
+    ssize_t currentWorkerIndex() {
+        const WorkerContext& context = workerContext();
+        return (context.pool == this) ? static_cast<ssize_t>(context.id) : -1;
+    }
+
+
+    // An instance of T for each worker, for jobs to accumulate into or use as a buffer without locking
+    template<typename T>
+    class WorkerLocal;
+
+
+    // A stream of jobs run one at a time in the order they were added, by whichever worker is free
+    class Strand;
+
+
+    // Called with the exception when a job (other than one from submit() or a TaskGroup) throws
+    using ErrorHandler = std::function<void(std::exception_ptr)>;
+
+
+    // Set the function to call when a job throws, from the worker that ran it
+    // The handler can be called from several workers at once. Without one, exceptions from jobs are only counted by
+    // errorCount(). Anything thrown by the handler itself is ignored. Pass nullptr to remove the handler.
+    void setErrorHandler(ErrorHandler handler) {
+        std::shared_ptr<const ErrorHandler> new_handler;
+        if (handler) {
+            new_handler = std::make_shared<const ErrorHandler>(std::move(handler));
+        }
+        std::lock_guard<std::mutex> e_lk(m_error_mutex);
+        m_error_handler = std::move(new_handler);
+    }
+
+
+    // Get the number of exceptions thrown by jobs that went to the error handler
+    uint64_t errorCount() {
+        return m_job_errors;
+    }
+
+
+    // Set the most jobs that can be queued at once, or 0 for no limit (the default)
+    // Once there are this many jobs on the queues (including workers' deques), adding a job from outside of the
+    // pool blocks until the workers have taken enough of them off, tryAddJob() returns false and addJobFor() waits
+    // up to its timeout. Blocked producers are woken once a quarter of the capacity has freed up, so that they
+    // refill the queue in batches rather than on every job. Jobs added by the pool's own jobs, and jobs from timers
+    // falling due, are never held up, so they can take the queue over capacity for a while.
+    void setQueueCapacity(size_t capacity) {
+        std::lock_guard<std::mutex> s_lk(m_space_mutex);
+        m_queue_capacity = capacity;
+        m_space_watermark = capacity - std::min(std::max<size_t>(capacity / 4, 1), capacity);
+        m_space_cv.notify_all();
+    }
+
+
+    size_t queueCapacity() {
+        return m_queue_capacity;
+    }
+
+
+    // Set the most jobs (from 1 to 32, the default) that a worker takes off a queue at once
+    // A worker takes its share of the queue, split between the workers, up to this many jobs, so that a deep queue
+    // of short jobs costs one queue lock per batch rather than per job. The batch goes onto the worker's own deque,
+    // where idle workers steal from it as in work stealing mode, so that a job in a batch never has to wait for the
+    // job ahead of it. Batched jobs are still queued jobs, discarded by clearQueue() and stop() like the rest.
+    void setDequeueBatch(size_t max_jobs) {
+        size_t most_jobs = MAX_QUEUE_SHARE;
+        m_dequeue_batch = std::min(std::max<size_t>(max_jobs, 1), most_jobs);
+    }
+
+
+    size_t dequeueBatch() {
+        return m_dequeue_batch;
+    }
+
+
+    // Get the number of cancelled jobs that have been skipped rather than run
+    uint64_t cancelledJobs() {
+        return m_cancelled_jobs;
+    }
+
+
+    // Get how many times idle workers have spun, yielded and slept while waiting for jobs
+    IdleStats idleStats() {
+        return snapshot().total.idle;
+    }
+
+
+    // Get the metrics of each worker and their totals, without stopping the workers
+    // Each worker's counters are read one at a time while it carries on running jobs, so a snapshot taken while
+    // the pool is busy may be a job or two out between counters.
+    PoolMetrics snapshot() {
+        PoolMetrics metrics;
+        {
+            std::lock_guard<std::mutex> m_lk(m_management_mutex);    // worker slots are only added with the lock held
+            uint64_t now = tp_detail::nowNanoseconds();
+            metrics.workers.reserve(m_worker_storage.size());
+            for (const auto& worker : m_worker_storage) {
+                metrics.workers.push_back(readMetrics(worker->metrics, now));
+            }
+        }
+
+        WorkerMetrics& total = metrics.total;
+        for (const WorkerMetrics& worker : metrics.workers) {
+            total.jobs_executed += worker.jobs_executed;
+            total.busy_ns += worker.busy_ns;
+            total.idle_ns += worker.idle_ns;
+            total.steals += worker.steals;
+            total.peak_queue_depth = std::max(total.peak_queue_depth, worker.peak_queue_depth);
+            for (size_t bucket = 0; bucket < WorkerMetrics::QUEUE_WAIT_BUCKETS; ++bucket) {
+                total.queue_wait[bucket] += worker.queue_wait[bucket];
+            }
+            total.idle.spins += worker.idle.spins;
+            total.idle.yields += worker.idle.yields;
+            total.idle.parks += worker.idle.parks;
+        }
+
+        metrics.pending_jobs = pendingJobs();
+        metrics.queued_jobs = queuedJobs();
+        metrics.job_errors = errorCount();
+        metrics.cancelled_jobs = cancelledJobs();
+        return metrics;
+    }
+
+
+    // Get the count of queued and running jobs
+    // As with queuedJobs() and runningJobs() this only reads atomic counters, and never takes a lock, so it can be
+    // polled as often as needed without getting in the way of the workers. Busy workers count the jobs they have run
+    // off in batches, so this can include a few dozen finished jobs per worker until each one next falls idle.
+    size_t pendingJobs() {
+        ssize_t pending_jobs = m_pending_jobs;
+        return (pending_jobs > 0) ? static_cast<size_t>(pending_jobs) : 0;
+    }
+
+
+    // Get the count of queued jobs
+    size_t queuedJobs() {
+        return m_queued_jobs + m_key_queued;
+    }
+
+
+    // Get the count of running jobs
+    // The two counters are read one after the other, so while jobs are being added and completed this is only a
+    // close estimate.
+    size_t runningJobs() {
+        size_t queued_jobs = queuedJobs();
+        size_t pending_jobs = pendingJobs();
+        return (pending_jobs > queued_jobs) ? (pending_jobs - queued_jobs) : 0;
+    }
+    
+
+    // Wait for all pending jobs to complete
+    // Any number of threads can wait() at once. To wait for some jobs while others carry on, see TaskGroup.
+    void wait() {
+        std::unique_lock<std::mutex> m_lk(m_management_mutex);
+
+        if (m_pending_jobs > 0) {
+            ++m_waiters;
+            m_counter_cv.wait(m_lk, [this](){ return (m_pending_jobs == 0); });
+            --m_waiters;
+        }
+    }
+
+
+    // Clear the job queue and return the number of cleared jobs
+    size_t clearQueue() {
+        std::lock_guard<std::mutex> m_lk(m_management_mutex);
+
+        size_t queued_jobs_cleared = 0;
+        for (CountedQueue& lane_queue : m_lanes) {
+            queued_jobs_cleared += lane_queue.clear();
+        }
+        for (const auto& node_queue : m_node_queues) {
+            queued_jobs_cleared += node_queue->clear();
+        }
+        for (const auto& partition : m_partition_storage) {
+            queued_jobs_cleared += partition->m_queue.clear();
+        }
+        for (const auto& worker : m_worker_storage) {
+            std::lock_guard<std::mutex> d_lk(worker->deque_mutex);
+            size_t deque_jobs_cleared = worker->deque.clear();
+            m_deque_jobs -= deque_jobs_cleared;
+            queued_jobs_cleared += deque_jobs_cleared;
+        }
+        releaseQueueSpace(queued_jobs_cleared);
+
+        // shards left on a ready list are found empty when they are taken off it
+        size_t key_jobs_cleared = 0;
+        KeyShard* shards = m_key_shards.load(std::memory_order_acquire);
+        for (size_t i = 0; (shards != nullptr) && (i < KEY_SHARDS); ++i) {
+            std::lock_guard<std::mutex> k_lk(shards[i].mutex);
+            key_jobs_cleared += shards[i].jobs.clear();
+        }
+        m_key_queued -= key_jobs_cleared;
+        queued_jobs_cleared += key_jobs_cleared;
+
+        if (((m_pending_jobs -= queued_jobs_cleared) == 0) && (m_waiters > 0)) {
+            m_counter_cv.notify_all();
+        }
+
+        return queued_jobs_cleared;
+    }
+
+private:
+
+    // A priority lane, NUMA node or partition queue, with a count of its jobs so that workers can skip it while it is
+    // empty
+    struct CountedQueue {
+        QueuePolicy queue;
+        std::atomic<size_t> queued{0};
+
+        size_t clear() {
+            size_t cleared = queue.clear();
+            queued -= cleared;
+            return cleared;
+        }
+    };
+
+
+    static constexpr size_t PRIORITY_LEVELS = 3;
+
+    // Times a worker passes over a waiting lower priority lane before it takes a job from it regardless
+    static constexpr size_t STARVATION_LIMIT = 16;
+
+    // Most jobs a worker will take off a queue at once, see setDequeueBatch()
+    static constexpr size_t MAX_QUEUE_SHARE = 32;
+
+    // Jobs a worker runs between counting them off m_pending_jobs, see runJob()
+    static constexpr size_t COMPLETION_BATCH = 32;
+
+    // Shards that AffinityKeys are hashed into, and the most of them that wait on a worker's inbox before any
+    // worker can take them, see addJob(AffinityKey, work_func)
+    static constexpr size_t KEY_SHARDS = 256;
+    static constexpr size_t KEY_INBOX_LIMIT = 4;
+
+
+    // Counters behind a worker's WorkerMetrics, padded out onto cache lines of their own as they are written for
+    // every job. Only the worker's own thread writes them, so that they can be updated with relaxed loads and
+    // stores rather than locked adds, and read at any time.
+    // The clock is kept off the path of a job: busy time is the time the worker's thread has been running less the
+    // time it has spent idle, which is timed as it goes idle, and only sampled jobs are timed on the queue.
+    struct MetricsCounters {
+        char pad_before[tp_detail::CACHE_LINE_SIZE];
+        std::atomic<uint64_t> jobs_executed{0};
+        std::atomic<uint64_t> running_ns{0};        // of threads that have since stopped
+        std::atomic<uint64_t> running_since{0};     // when the current thread started, 0 if stopped
+        std::atomic<uint64_t> idle_ns{0};           // of idle periods that have since ended
+        std::atomic<uint64_t> idle_since{0};        // when the current idle period began, 0 if not idle
+        std::atomic<uint64_t> steals{0};
+        std::atomic<uint64_t> peak_queue_depth{0};
+        std::atomic<uint64_t> idle_spins{0};
+        std::atomic<uint64_t> idle_yields{0};
+        std::atomic<uint64_t> idle_parks{0};
+        std::atomic<uint64_t> queue_wait[WorkerMetrics::QUEUE_WAIT_BUCKETS] = {};
+        char pad_after[tp_detail::CACHE_LINE_SIZE];
+    };
+
+
+    // Whether a key shard is waiting on a ready list or running one of its jobs, only changed with its mutex held
+    enum class ShardState {
+        Idle,       // no jobs
+        Ready,      // on a ready list
+        Running
+    };
+
+
+    // The jobs added with AffinityKeys that hash to one shard, run one at a time in order
+    struct KeyShard {
+        std::mutex mutex;
+        tp_detail::JobRing jobs;
+        ShardState state = ShardState::Idle;
+        size_t index = 0;
+        KeyShard* next_ready = nullptr;     // guarded by the lock of the ready list it is on
+    };
+
+
+    // A FIFO list of key shards with jobs to run, linked through KeyShard::next_ready
+    struct ReadyShards {
+        KeyShard* head = nullptr;
+        KeyShard* tail = nullptr;
+
+        void push(KeyShard* shard) {
+            shard->next_ready = nullptr;
+            if (tail != nullptr) {
+                tail->next_ready = shard;
+            } else {
+                head = shard;
+            }
+            tail = shard;
+        }
+
+        KeyShard* pop() {
+            KeyShard* shard = head;
+            if (shard != nullptr) {
+                head = shard->next_ready;
+                tail = (head != nullptr) ? tail : nullptr;
+            }
+            return shard;
+        }
+    };
+
+
+    // What a worker slot's thread is doing, only changed with m_management_mutex held
+    enum class SlotState {
+        Stopped,    // no thread
+        Running,
+        Retiring,   // asked to exit by resize(), which the thread will do once it has finished its jobs
+        Exited      // the thread has retired, and needs join()ing
+    };
+
+
+    // Per-worker state
+    struct Worker {
+        std::unique_ptr<std::thread> thread;
+        std::atomic<SlotState> state{SlotState::Stopped};
+        std::mutex deque_mutex;     // owner pushes and pops at the back, thieves steal from the front
+        tp_detail::JobRing deque;
+
+        ReadyShards inbox;          // key shards handed to this worker, with deque_mutex held
+        std::atomic<size_t> inbox_count{0};
+        bool inbox_open = false;    // while the thread is running, so that shards aren't left in a stopped slot
+
+        // The worker's parking slot, which it sleeps on when idle so that it can be woken on its own
+        std::mutex park_mutex;
+        std::condition_variable park_cv;
+        bool wake_requested = false;        // with park_mutex held
+        std::atomic<bool> parked{false};    // asleep on its parking slot, so needs waking for its inbox
+        std::atomic<bool> idle_listed{false};   // on the idle stack (or just popped off it), see pushIdleWorker()
+        std::atomic<uint32_t> idle_next{0}; // id + 1 of the next worker down the idle stack, 0 for none
+
+        size_t lane_skips[PRIORITY_LEVELS] = {};    // times in a row we have passed over each waiting lane
+        size_t partition_turn = 0;          // 0 for the pool's own queues, or 1 + index of a partition
+        size_t partition_credit = 0;        // jobs taken on this turn
+        size_t unpublished_jobs = 0;        // jobs run and not yet counted off m_pending_jobs, see runJob()
+
+
+        std::atomic<size_t> node{NO_NODE};  // NUMA node the worker is placed on, if any, seen by stealing workers
+        std::vector<unsigned> cpus; // cpus the worker is pinned to, if any
+
+        WorkerArena arena;          // only touched by the worker's own thread
+        MetricsCounters metrics;
+    };
+
+
+    // Start worker threads if we are stopped, m_management_mutex must be held
+    bool startWorkers(size_t worker_count) {
+        if (!m_stopped) {
+            return false;
+        } else {
+            m_stopped = false;
+            
+            // create worker threads
+            if (worker_count == 0) {
+                worker_count = std::thread::hardware_concurrency();
+            }
+            m_max_workers = 0;
+            if (m_scaling.mode == WorkerScaling::Mode::Elastic) {
+                size_t max_workers = (m_scaling.max_workers > 0) ? m_scaling.max_workers : std::thread::hardware_concurrency();
+                max_workers = std::max(max_workers, m_scaling.min_workers);
+                worker_count = std::min(std::max(worker_count, m_scaling.min_workers), max_workers);
+                m_scaling_queue_depth = m_scaling.queue_depth;
+                m_max_workers = max_workers;
+            }
+            growWorkers(worker_count);
+            
+            return true;
+        }
+        
+    }
+
+
+    // Start count more workers, m_management_mutex must be held
+    // Workers that are retiring are kept on first, then stopped and retired workers' slots are reused (in that order,
+    // so that any jobs left on a stopped worker's deque are run by its own worker again), and then new slots added.
+    void growWorkers(size_t count) {
+        for (size_t id = 0; (id < workerSlots()) && (count > 0); ++id) {
+            Worker& worker = workerSlot(id);
+            if (worker.state == SlotState::Retiring) {
+                worker.state = SlotState::Running;
+                ++m_worker_count;
+                --count;
+            }
+        }
+
+        for (size_t id = 0; count > 0; ++id) {
+            if (id == workerSlots()) {
+                addWorkerSlot();
+            }
+            Worker& worker = workerSlot(id);
+            if ((worker.state == SlotState::Stopped) || (worker.state == SlotState::Exited)) {
+                if (worker.thread) {
+                    worker.thread->join();  // it has retired, so this only waits for it to return from workerLoop()
+                }
+                placeWorker(id);
+                worker.state = SlotState::Running;
+                worker.thread = std::make_unique<std::thread>(&BasicThreadPool::workerLoop, this, id);
+                ++m_worker_count;
+                --count;
+            }
+        }
+    }
+
+
+    // Add an empty worker slot, m_management_mutex must be held
+    void addWorkerSlot() {
+        size_t slots = m_worker_slots;
+        if (slots == m_worker_capacity) {
+            size_t capacity = (slots > 0) ? (slots * 2) : MIN_WORKER_CAPACITY;
+            std::unique_ptr<Worker*[]> table(new Worker*[capacity]);
+            std::copy(m_worker_table.load(), m_worker_table.load() + slots, table.get());
+            m_worker_table.store(table.get(), std::memory_order_release);
+            m_worker_tables.push_back(std::move(table));
+            m_worker_capacity = capacity;
+        }
+        m_worker_storage.emplace_back(std::make_unique<Worker>());
+        m_worker_table.load()[slots] = m_worker_storage.back().get();
+        m_worker_slots.store(slots + 1, std::memory_order_release);
+    }
+
+
+    // Number of worker slots, including those of stopped and retired workers
+    size_t workerSlots() {
+        return m_worker_slots.load(std::memory_order_acquire);
+    }
+
+
+    // Look up a worker slot, without a lock
+    Worker& workerSlot(size_t id) {
+        return *m_worker_table.load(std::memory_order_acquire)[id];
+    }
+
+
+    // Set the cpus and NUMA node of a worker from the placement
+    void placeWorker(size_t id) {
+        Worker& worker = workerSlot(id);
+        const std::vector<std::vector<unsigned>>& node_cpus = tp_detail::numaNodeCpus();
+
+        switch (m_placement.mode) {
+        case WorkerPlacement::Mode::Anywhere:
+            worker.cpus.clear();
+            worker.node = NO_NODE;
+            break;
+        case WorkerPlacement::Mode::Pinned:
+            worker.cpus = m_placement.core_sets[id % m_placement.core_sets.size()];
+            worker.node = NO_NODE;
+            for (size_t node = 0; (node < node_cpus.size()) && (!worker.cpus.empty()); ++node) {
+                if (std::find(node_cpus[node].begin(), node_cpus[node].end(), worker.cpus.front()) != node_cpus[node].end()) {
+                    worker.node = node;
+                }
+            }
+            break;
+        case WorkerPlacement::Mode::SpreadNumaNodes:
+            worker.node = id % node_cpus.size();
+            worker.cpus = node_cpus[id % node_cpus.size()];
+            break;
+        }
+    }
+
+
+    // Add to one of a worker's MetricsCounters, from the worker's own thread
+    static void addToCounter(std::atomic<uint64_t>& counter, uint64_t amount) {
+        if (MetricsPolicy::enabled) {
+            counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        }
+    }
+
+
+    // Record the queue depth as a job starts, and how long it waited on the queue if it was sampled
+    void recordJobStart(MetricsCounters& metrics, const Job& job) {
+        if (MetricsPolicy::enabled) {
+            uint64_t queue_depth = m_queued_jobs.load(std::memory_order_relaxed) + 1;
+            if (queue_depth > metrics.peak_queue_depth.load(std::memory_order_relaxed)) {
+                metrics.peak_queue_depth.store(queue_depth, std::memory_order_relaxed);
+            }
+        }
+
+        if (job.queuedAt() == 0) {
+            return;
+        }
+        uint64_t now = tp_detail::nowNanoseconds();
+        if (MetricsPolicy::enabled) {
+            size_t bucket = 0;
+            for (uint64_t wait_us = (now > job.queuedAt()) ? ((now - job.queuedAt()) / 1000) : 0;
+                 (wait_us > 0) && (bucket < WorkerMetrics::QUEUE_WAIT_BUCKETS - 1); wait_us >>= 1) {
+                ++bucket;
+            }
+            addToCounter(metrics.queue_wait[bucket], 1);
+        }
+
+        if ((m_max_workers > 0) && (now > job.queuedAt() + static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(m_scaling.queue_wait).count()))) {
+            scaleUp(true);
+        }
+    }
+
+
+    // Read a worker's counters into its WorkerMetrics, as of now
+    static WorkerMetrics readMetrics(const MetricsCounters& counters, uint64_t now) {
+        WorkerMetrics metrics;
+        metrics.jobs_executed = counters.jobs_executed.load(std::memory_order_relaxed);
+
+        uint64_t running_since = counters.running_since.load(std::memory_order_relaxed);
+        uint64_t idle_since = counters.idle_since.load(std::memory_order_relaxed);
+        uint64_t running_ns = counters.running_ns.load(std::memory_order_relaxed);
+        metrics.idle_ns = counters.idle_ns.load(std::memory_order_relaxed);
+        running_ns += ((running_since != 0) && (now > running_since)) ? (now - running_since) : 0;
+        metrics.idle_ns += ((idle_since != 0) && (now > idle_since)) ? (now - idle_since) : 0;
+        metrics.busy_ns = (running_ns > metrics.idle_ns) ? (running_ns - metrics.idle_ns) : 0;
+
+        metrics.steals = counters.steals.load(std::memory_order_relaxed);
+        metrics.peak_queue_depth = counters.peak_queue_depth.load(std::memory_order_relaxed);
+        for (size_t bucket = 0; bucket < WorkerMetrics::QUEUE_WAIT_BUCKETS; ++bucket) {
+            metrics.queue_wait[bucket] = counters.queue_wait[bucket].load(std::memory_order_relaxed);
+        }
+        metrics.idle.spins = counters.idle_spins.load(std::memory_order_relaxed);
+        metrics.idle.yields = counters.idle_yields.load(std::memory_order_relaxed);
+        metrics.idle.parks = counters.idle_parks.load(std::memory_order_relaxed);
+        return metrics;
+    }
+
+
+    // Check whether an idle worker has anything to do
+    bool idleWorkerWoken(const Worker& worker) {
+        return ((m_queued_jobs > 0) || (m_ready_shard_count > 0) || (worker.inbox_count > 0) || (m_stopped) ||
+                (worker.state == SlotState::Retiring));
+    }
+
+
+    // Wait for a job to be queued (or for the pool to stop), following the idle policy and then sleeping
+    // The worker sleeps on its own parking slot, after putting itself on the idle stack for wakeWorkers() to find.
+    // It is counted in m_idle_workers once it is on the stack and before it looks for work for the last time, so
+    // that anyone queueing a job after that look sees it as idle and wakes it (or another idle worker).
+    // Returns true if the worker has been retired for sleeping too long in an elastic pool.
+    bool idleWait(Worker& worker, size_t id) {
+        auto has_work = [this, &worker](){ return idleWorkerWoken(worker); };
+        auto entered = [&worker](IdlePhase phase){
+            addToCounter((phase == IdlePhase::Spin) ? worker.metrics.idle_spins : worker.metrics.idle_yields, 1);
+        };
+        if (m_idle_policy.wait(m_idle_strategy, has_work, entered)) {
+            return false;
+        }
+
+        addToCounter(worker.metrics.idle_parks, 1);
+        bool woken = true;
+        {
+            std::unique_lock<std::mutex> p_lk(worker.park_mutex);
+            worker.wake_requested = false;
+            worker.parked = true;
+            if (!worker.idle_listed.exchange(true)) {
+                pushIdleWorker(id);
+            }
+            ++m_idle_workers;
+
+            auto woken_up = [&worker, &has_work](){ return (worker.wake_requested || has_work()); };
+            if (m_max_workers > 0) {
+                woken = worker.park_cv.wait_for(p_lk, m_scaling.idle_timeout, woken_up);
+            } else {
+                worker.park_cv.wait(p_lk, woken_up);
+            }
+            worker.parked = false;
+            --m_idle_workers;
+        }
+
+        if (!woken) {
+            std::lock_guard<std::mutex> m_lk(m_management_mutex);
+            if ((m_worker_count > m_scaling.min_workers) && (worker.state == SlotState::Running) && (!has_work())) {
+                worker.state = SlotState::Exited;
+                --m_worker_count;
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    // Push a worker that is going to sleep onto the idle stack, a lock-free LIFO list threaded through the workers'
+    // slots, so that the last worker to go idle is the first woken while its cache is still warm
+    // The stack's head holds the top worker's id + 1 in its low 32 bits and a count of changes in its high 32 bits,
+    // so that a worker popped and pushed again between another thread reading the head and swapping it is noticed.
+    // A worker is listed at most once, and may still be listed after it has been woken by something other than
+    // wakeWorkers(), in which case wakeIdleWorker() passes over it.
+    void pushIdleWorker(size_t id) {
+        Worker& worker = workerSlot(id);
+        uint64_t head = m_idle_stack.load();
+        uint64_t top;
+        do {
+            worker.idle_next.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+            top = (((head >> 32) + 1) << 32) | static_cast<uint64_t>(id + 1);
+        } while (!m_idle_stack.compare_exchange_weak(head, top));
+    }
+
+
+    bool popIdleWorker(size_t& id) {
+        uint64_t head = m_idle_stack.load();
+        while (static_cast<uint32_t>(head) != 0) {
+            size_t top_id = static_cast<uint32_t>(head) - 1;
+            uint64_t next = (((head >> 32) + 1) << 32) | workerSlot(top_id).idle_next.load(std::memory_order_relaxed);
+            if (m_idle_stack.compare_exchange_weak(head, next)) {
+                id = top_id;
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    // Wake the most recently idle worker that is still asleep, returning false if there are none
+    bool wakeIdleWorker() {
+        size_t id;
+        while (popIdleWorker(id)) {
+            Worker& worker = workerSlot(id);
+            worker.idle_listed = false;     // before looking, so that if it isn't asleep yet it lists itself again
+            if (wakeWorker(worker, true)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    // Wake a worker from its parking slot, if it is asleep there and hasn't been woken already
+    // Set only_if_asleep = false to have it look for work again if it is just about to go to sleep, as we have
+    // changed something it looks at without reaching it through the idle stack.
+    static bool wakeWorker(Worker& worker, bool only_if_asleep) {
+        {
+            std::lock_guard<std::mutex> p_lk(worker.park_mutex);
+            if (only_if_asleep && ((!worker.parked) || worker.wake_requested)) {
+                return false;
+            }
+            worker.wake_requested = true;
+        }
+        worker.park_cv.notify_one();
+        return true;
+    }
+
+
+    // Retire a worker that resize() has asked to retire, once it has run everything on its own deque
+    // Returns false if it should carry on, because it still has jobs or has been kept on by growWorkers().
+    bool retireWorker(Worker& worker) {
+        std::lock_guard<std::mutex> m_lk(m_management_mutex);
+        if (worker.state != SlotState::Retiring) {
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> d_lk(worker.deque_mutex);
+            if (!worker.deque.empty()) {
+                return false;
+            }
+        }
+        worker.state = SlotState::Exited;
+        return true;
+    }
+
+
+    // Start another worker if the pool is elastic and is falling behind, see WorkerScaling
+    // job_waited is true when a worker has just started a job that waited longer than the scaling's queue_wait.
+    void scaleUp(bool job_waited) {
+        size_t worker_count = m_worker_count;
+        if (worker_count >= m_max_workers) {
+            return;     // including when the pool isn't elastic
+        }
+        if (worker_count > 0) {
+            if ((m_idle_workers > 0) || (m_queued_jobs == 0)) {
+                return;
+            }
+            if ((!job_waited) && (m_queued_jobs <= m_scaling_queue_depth * worker_count)) {
+                return;
+            }
+        }
+
+        std::lock_guard<std::mutex> m_lk(m_management_mutex);
+        if ((!m_stopped) && (m_worker_count < m_max_workers)) {
+            growWorkers(1);
+        }
+    }
+
+
+    // Identity of the pool and worker that the calling thread belongs to, if any
+    struct WorkerContext {
+        BasicThreadPool* pool;
+        size_t id;
+    };
+
+    static WorkerContext& workerContext() {
+        static thread_local WorkerContext context = {nullptr, 0};
+        return context;
+    }
+
+
+    // Get the worker running on the calling thread, if work stealing and the thread is one of ours
+    Worker* localWorker() {
+        const WorkerContext& context = workerContext();
+        if ((!m_work_stealing) || (context.pool != this)) {
+            return nullptr;
+        }
+        return &workerSlot(context.id);
+    }
+
+
+    // Push jobs onto the local deque of the calling worker, waking idle workers if there are any to steal them
+    void addLocalJobs(Worker& worker, Job* jobs, size_t count) {
+        m_pending_jobs += count;
+        stampQueuedJobs(jobs, count);
+        {
+            std::lock_guard<std::mutex> d_lk(worker.deque_mutex);
+            for (size_t i = 0; i < count; ++i) {
+                worker.deque.pushBack(std::move(jobs[i]));
+            }
+            m_deque_jobs += count;
+        }
+        m_queued_jobs += count;
+        wakeWorkers(count);
+        scaleUp(false);
+    }
+
+
+    // Stamp one in QUEUE_WAIT_SAMPLE_INTERVAL of the jobs queued by each thread with the time, for the queue wait
+    // histogram and elastic scaling, so that most jobs are queued without reading the clock
+    // When tracing, every job gets an id for its events in the JobTrace as well.
+    void stampQueuedJobs(Job* jobs, size_t count) {
+        static thread_local size_t jobs_queued = 0;
+        bool sampling = (MetricsPolicy::enabled || (m_max_workers > 0));
+        uint64_t now = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (sampling && ((++jobs_queued % QUEUE_WAIT_SAMPLE_INTERVAL) == 0)) {
+                now = (now != 0) ? now : tp_detail::nowNanoseconds();
+                jobs[i].setQueuedAt(now);
+            }
+#ifdef CPP_TP_TRACE
+            jobs[i].setTraceId(tp_detail::traceQueuedJob());
+#endif
+        }
+    }
+
+
+    // Record that the calling thread has taken jobs it is going to run
+    static void traceDequeuedJobs(const Job* jobs, size_t count) {
+#ifdef CPP_TP_TRACE
+        for (size_t i = 0; i < count; ++i) {
+            tp_detail::traceEvent(tp_detail::TraceEventType::Dequeued, jobs[i].traceId());
+        }
+#else
+        (void)jobs;
+        (void)count;
+#endif
+    }
+
+
+    CountedQueue& lane(Priority priority) {
+        return m_lanes[static_cast<size_t>(priority)];
+    }
+
+
+    // Push jobs onto a queue, and wake idle workers to run them
+    // Jobs from outside of the pool wait for room below the queue capacity, unless wait_for_space = false. While
+    // draining, they are refused instead.
+    void pushQueuedJobs(CountedQueue& queue, Job* jobs, size_t count, bool wait_for_space = true) {
+        bool external = (workerContext().pool != this);
+        if (m_draining && external) {
+            m_refused_jobs += count;    // the jobs are destroyed unrun by our caller
+            completeJobs(count);
+            return;
+        }
+        stampQueuedJobs(jobs, count);
+        if ((!external) || (!wait_for_space) || (m_queue_capacity == 0)) {
+            pushJobs(queue, jobs, count, false);
+        } else {
+            size_t pushed = 0;
+            while (pushed < count) {
+                size_t reserved = waitForQueueSpace(count - pushed, nullptr);
+                pushJobs(queue, jobs + pushed, reserved, true);
+                pushed += reserved;
+            }
+        }
+        scaleUp(false);
+    }
+
+
+    // Push jobs onto a queue, yielding for as long as the queue policy is full
+    // Jobs are counted in m_queued_jobs as they are pushed, unless reserved = true as they already have been (see
+    // reserveQueueSpace()). Counting them any earlier would keep idle workers from sleeping while we yield. If the
+    // queue policy throws, the jobs not pushed are no longer counted as pending (or reserved) when it is rethrown.
+    // One of our own workers doesn't yield, as every worker might be doing the same with none left to make room, and
+    // runs the next job that won't fit itself instead.
+    void pushJobs(CountedQueue& queue, Job* jobs, size_t count, bool reserved) {
+        const WorkerContext& context = workerContext();
+        size_t pushed = 0;
+        while (true) {
+            size_t n;
+            try {
+                n = queue.queue.tryPushBulk(jobs + pushed, count - pushed);
+            } catch (...) {
+                if (reserved) {
+                    releaseQueueSpace(count - pushed);
+                }
+                completeJobs(count - pushed);
+                throw;
+            }
+            if (n > 0) {
+                queue.queued += n;
+                if (!reserved) {
+                    m_queued_jobs += n;
+                }
+                wakeWorkers(n);
+                pushed += n;
+            }
+            if (pushed == count) {
+                return;
+            }
+            if (context.pool == this) {
+                if (reserved) {
+                    releaseQueueSpace(1);
+                }
+                traceDequeuedJobs(jobs + pushed, 1);
+                runJob(context.id, jobs[pushed]);
+                ++pushed;
+                continue;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+
+    // Count up to count jobs as queued, as long as that keeps the queues within capacity, and return how many were
+    size_t reserveQueueSpace(size_t count) {
+        size_t capacity = m_queue_capacity;
+        if (capacity == 0) {
+            m_queued_jobs += count;
+            return count;
+        }
+        size_t queued_jobs = m_queued_jobs;
+        size_t reserved;
+        do {
+            if (queued_jobs >= capacity) {
+                return 0;
+            }
+            reserved = std::min(count, capacity - queued_jobs);
+        } while (!m_queued_jobs.compare_exchange_weak(queued_jobs, queued_jobs + reserved));
+        return reserved;
+    }
+
+
+    // Reserve room for up to count jobs, sleeping until there is some or deadline (if there is one) passes
+    // Returns how many jobs there is room for, 0 only if the deadline passed.
+    size_t waitForQueueSpace(size_t count, const std::chrono::steady_clock::time_point* deadline) {
+        while (true) {
+            size_t reserved = reserveQueueSpace(count);
+            if (reserved > 0) {
+                return reserved;
+            }
+            std::unique_lock<std::mutex> s_lk(m_space_mutex);
+            ++m_space_waiters;
+            // releaseQueueSpace() checks m_space_waiters after taking jobs off, and takes the lock to notify us
+            auto has_space = [this](){ return (m_queue_capacity == 0) || (m_queued_jobs < m_queue_capacity); };
+            bool has_space_now = true;
+            if (deadline == nullptr) {
+                m_space_cv.wait(s_lk, has_space);
+            } else {
+                has_space_now = m_space_cv.wait_until(s_lk, *deadline, has_space);
+            }
+            --m_space_waiters;
+            if (!has_space_now) {
+                return 0;
+            }
+        }
+    }
+
+
+    // Count jobs as taken off the queues, waking producers waiting for room if enough of it has freed up
+    void releaseQueueSpace(size_t count) {
+        size_t queued_jobs = (m_queued_jobs -= count);
+        if ((m_space_waiters > 0) && (queued_jobs <= m_space_watermark)) {
+            std::lock_guard<std::mutex> s_lk(m_space_mutex);
+            m_space_cv.notify_all();
+        }
+    }
+
+
+    // Add a job to the normal queue if there is room for it (by deadline, if there is one), see addJobFor()
+    template<typename F>
+    bool addJobBy(F&& work_func, const std::chrono::steady_clock::time_point* deadline) {
+        if (workerContext().pool == this) {
+            addJob(std::forward<F>(work_func));     // never held up (or refused)
+            return true;
+        }
+        if (m_draining) {
+            return false;
+        }
+        if (((deadline == nullptr) ? reserveQueueSpace(1) : waitForQueueSpace(1, deadline)) == 0) {
+            return false;
+        }
+        Job job;
+        try {
+            job = Job(std::forward<F>(work_func));
+        } catch (...) {
+            releaseQueueSpace(1);
+            throw;
+        }
+        ++m_pending_jobs;
+        stampQueuedJobs(&job, 1);
+        CountedQueue& queue = lane(Priority::Normal);
+        while (true) {
+            bool pushed;
+            try {
+                pushed = queue.queue.tryPush(job);
+            } catch (...) {
+                releaseQueueSpace(1);
+                completeJobs(1);
+                throw;
+            }
+            if (pushed) {
+                break;
+            }
+            if ((deadline == nullptr) || (std::chrono::steady_clock::now() >= *deadline)) {
+                releaseQueueSpace(1);
+                completeJobs(1);
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        ++queue.queued;
+        wakeWorkers(1);
+        scaleUp(false);
+        return true;
+    }
+
+
+    // Wake up to count idle workers for newly queued jobs, one each, most recently idle first
+    // The jobs are counted in m_queued_jobs before m_idle_workers is read, so a worker going idle either sees them
+    // or is counted here, and is on the idle stack by then (see idleWait()).
+    void wakeWorkers(size_t count) {
+        if (m_idle_workers == 0) {
+            return;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if (!wakeIdleWorker()) {
+                break;
+            }
+        }
+    }
+
+
+    template<typename Container>
+    void addContainerJobs(Container& work_funcs, std::true_type) {
+        using Element = typename std::decay<decltype(*std::begin(work_funcs))>::type;
+        static_assert(std::is_copy_constructible<Element>::value, "addJobs() copies the callables of a container passed as an lvalue, so pass a container of move-only callables (such as Jobs) with std::move()");
+        addJobs(std::begin(work_funcs), std::end(work_funcs));
+    }
+
+
+    template<typename Container>
+    void addContainerJobs(Container& work_funcs, std::false_type) {
+        addJobs(std::make_move_iterator(std::begin(work_funcs)), std::make_move_iterator(std::end(work_funcs)));
+    }
+
+
+    // Size of an iterator range, if we can know it without walking it
+    template<typename InputIt>
+    static size_t batchSize(InputIt first, InputIt last, std::forward_iterator_tag) {
+        return static_cast<size_t>(std::distance(first, last));
+    }
+
+
+    template<typename InputIt>
+    static size_t batchSize(InputIt, InputIt, std::input_iterator_tag) {
+        return 0;
+    }
+
+
+    // Pop a job from the back of our own deque
+    bool popOwnJob(size_t id, Job& job) {
+        Worker& worker = workerSlot(id);
+        std::lock_guard<std::mutex> d_lk(worker.deque_mutex);
+        if (worker.deque.empty()) {
+            return false;
+        }
+        worker.deque.popBack(job);
+        --m_deque_jobs;
+        releaseQueueSpace(1);
+        traceDequeuedJobs(&job, 1);
+        return true;
+    }
+
+
+    // Steal a job from the front of another worker's deque, trying workers on our own NUMA node first
+    bool stealJob(size_t id, Job& job) {
+        size_t worker_count = workerSlots();    // including any stopped workers' slots, with leftover jobs
+        size_t node = workerSlot(id).node;
+
+        for (int pass = 0; pass < 2; ++pass) {
+            for (size_t i = 1; i < worker_count; ++i) {
+                Worker& victim = workerSlot((id + i) % worker_count);
+                if ((node != NO_NODE) && ((victim.node == node) != (pass == 0))) {
+                    continue;   // first pass is for workers on our node, second for the rest
+                }
+                std::lock_guard<std::mutex> d_lk(victim.deque_mutex);
+                if (!victim.deque.empty()) {
+                    victim.deque.popFront(job);
+                    --m_deque_jobs;
+                    releaseQueueSpace(1);
+                    traceDequeuedJobs(&job, 1);
+                    addToCounter(workerSlot(id).metrics.steals, 1);
+                    return true;
+                }
+            }
+            if (node == NO_NODE) {
+                break;          // no node preference, so the first pass tried everyone
+            }
+        }
+        return false;
+    }
+
+
+    // Fetch the next job for a worker to run, blocking until there is one
+    // Returns false when the threadpool is stopped or the worker has retired
+    bool fetchJob(size_t id, Job& job) {
+        Worker& worker = workerSlot(id);
+        while (!m_stopped) {
+            if ((worker.state == SlotState::Retiring) && retireWorker(worker)) {
+                return false;
+            }
+            if (tryFetchJob(id, job)) {
+                return true;
+            }
+            publishCompletedJobs(worker);
+            MetricsCounters& metrics = worker.metrics;
+            uint64_t idle_since = MetricsPolicy::enabled ? tp_detail::nowNanoseconds() : 0;
+            metrics.idle_since.store(idle_since, std::memory_order_relaxed);
+            bool retired = idleWait(worker, id);
+            if (MetricsPolicy::enabled) {
+                addToCounter(metrics.idle_ns, tp_detail::nowNanoseconds() - idle_since);
+                metrics.idle_since.store(0, std::memory_order_relaxed);
+            }
+            if (retired) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+
+    // Fetch a job for a worker to run if there is one, without blocking
+    // Jobs are taken from the high priority lane first, then from a work stealing worker's own deque, the queue of
+    // the worker's own NUMA node, the normal priority lane, other workers' deques, other nodes' queues and finally
+    // the low priority lane. Everything but the lanes counts as normal priority for the starvation guard.
+    bool tryFetchJob(size_t id, Job& job) {
+        Worker& worker = workerSlot(id);
+
+        for (size_t starved = PRIORITY_LEVELS - 1; starved > 0; --starved) {
+            if ((worker.lane_skips[starved] >= STARVATION_LIMIT) && takeCountedJob(m_lanes[starved], id, job)) {
+                worker.lane_skips[starved] = 0;
+                return true;
+            }
+        }
+
+        Priority priority;
+        if (takeCountedJob(lane(Priority::High), id, job)) {
+            priority = Priority::High;
+        } else if (tryFetchSharedJob(worker, id, job)) {
+            priority = Priority::Normal;
+        } else if (takeCountedJob(lane(Priority::Low), id, job)) {
+            priority = Priority::Low;
+        } else {
+            return false;
+        }
+
+        // count the lower lanes with jobs waiting that we have just passed over
+        for (size_t lower = static_cast<size_t>(priority) + 1; lower < PRIORITY_LEVELS; ++lower) {
+            worker.lane_skips[lower] = (m_lanes[lower].queued > 0) ? (worker.lane_skips[lower] + 1) : 0;
+        }
+        return true;
+    }
+
+
+    // Fetch a normal priority job, from the pool's own queues or a partition, taking turns between them by weight
+    bool tryFetchSharedJob(Worker& worker, size_t id, Job& job) {
+        size_t partition_count = m_partition_count.load(std::memory_order_acquire);
+        if (partition_count == 0) {
+            return tryFetchNormalJob(worker, id, job);
+        }
+        Partition* const* partitions = m_partition_table.load(std::memory_order_acquire);
+
+        for (size_t tried = 0; tried <= partition_count; ++tried) {
+            size_t turn = worker.partition_turn % (partition_count + 1);
+            Partition* partition = (turn > 0) ? partitions[turn - 1] : nullptr;
+            bool found = (partition != nullptr) ? takeExternalJob(partition->m_queue, job) : tryFetchNormalJob(worker, id, job);
+            if (found && (++worker.partition_credit < ((partition != nullptr) ? partition->m_weight : 1))) {
+                return true;
+            }
+            worker.partition_credit = 0;
+            worker.partition_turn = turn + 1;
+            if (found) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    bool tryFetchNormalJob(Worker& worker, size_t id, Job& job) {
+        if (takeInboxJob(worker, job)) {
+            return true;
+        }
+        if (popOwnJob(id, job)) {
+            return true;
+        }
+        size_t own_node = worker.node;
+        if ((own_node != NO_NODE) && takeCountedJob(*m_node_queues[own_node], id, job)) {
+            return true;
+        }
+        if (takeCountedJob(lane(Priority::Normal), id, job)) {
+            return true;
+        }
+        if (takeReadyShardJob(job)) {
+            return true;
+        }
+        if ((m_deque_jobs > 0) && stealJob(id, job)) {   // batches taken off a queue are stolen when not work stealing too
+            return true;
+        }
+        for (size_t node = 0; node < m_node_queues.size(); ++node) {
+            if ((node != own_node) && takeCountedJob(*m_node_queues[node], id, job)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    bool takeCountedJob(CountedQueue& queue, size_t id, Job& job) {
+        if (queue.queued == 0) {
+            return false;   // skip empty queues without touching them
+        }
+        size_t taken = takeQueuedJob(queue.queue, id, job);
+        queue.queued -= taken;
+        return (taken > 0);
+    }
+
+
+    // Take a job from a queue, along with a share of the queue onto our own deque, so that we (and anyone stealing
+    // from us) can run it without coming back to the queue
+    // The share is the queue's jobs split between the workers, up to the dequeue batch, so that a short queue
+    // isn't taken by one worker while the others are idle. Returns the number of jobs taken off the queue.
+    size_t takeQueuedJob(QueuePolicy& queue, size_t id, Job& job) {
+        size_t limit = m_dequeue_batch;
+        if (limit <= 1) {
+            if (!queue.tryPop(job)) {
+                return 0;
+            }
+            releaseQueueSpace(1);
+            traceDequeuedJobs(&job, 1);
+            return 1;
+        }
+
+        size_t worker_count = m_worker_count;
+        size_t share = m_queued_jobs / ((worker_count > 0) ? worker_count : 1);
+        share = (share < 1) ? 1 : ((share < limit) ? share : limit);
+
+        Job jobs[MAX_QUEUE_SHARE];
+        size_t count = queue.tryPopBulk(jobs, share);
+        if (count == 0) {
+            return 0;
+        }
+
+        job = std::move(jobs[0]);
+        releaseQueueSpace(1);
+        traceDequeuedJobs(&job, 1);     // the rest are dequeued again by whichever worker takes them off our deque
+        if (count > 1) {
+            Worker& worker = workerSlot(id);
+            std::lock_guard<std::mutex> d_lk(worker.deque_mutex);
+            for (size_t i = 1; i < count; ++i) {
+                worker.deque.pushFront(std::move(jobs[i]));
+            }
+            m_deque_jobs += count - 1;
+        }
+        return count;
+    }
+
+
+    // Run a fetched job and count it as complete
+    // Jobs run by a worker while helping inside another job rewind the arena only as far as they found it.
+    void runJob(size_t id, Job& job) {
+        Worker& worker = workerSlot(id);
+        MetricsCounters& metrics = worker.metrics;
+        recordJobStart(metrics, job);
+        WorkerArena::Mark arena_mark = worker.arena.mark();
+        uint64_t trace_id = job.traceId();
+        tp_detail::traceEvent(tp_detail::TraceEventType::Started, trace_id);
+
+        invokeJob(job); // run the job and return the result via callback
+        job.reset();    // destroy its captures now rather than when the next job is fetched
+        tp_detail::traceEvent(tp_detail::TraceEventType::Finished, trace_id);
+        worker.arena.rewind(arena_mark);
+        addToCounter(metrics.jobs_executed, 1);
+
+        if (++worker.unpublished_jobs >= COMPLETION_BATCH) {
+            publishCompletedJobs(worker);
+        }
+    }
+
+
+    // Count the jobs a worker has run off m_pending_jobs in one go
+    // Workers do this every COMPLETION_BATCH jobs rather than for every job, so that a stream of short jobs doesn't
+    // keep the pending count's cache line moving between them, and always before going idle or exiting, so that
+    // wait() and drain() see the pool fall idle.
+    void publishCompletedJobs(Worker& worker) {
+        if (worker.unpublished_jobs > 0) {
+            completeJobs(worker.unpublished_jobs);
+            worker.unpublished_jobs = 0;
+        }
+    }
+
+
+    // Run a job fetched by a thread that isn't one of our workers
+    // If the thread is another pool's worker, the job gets the use of its arena.
+    void runExternalJob(Job& job) {
+        WorkerArena* arena = tp_detail::currentArena();
+        WorkerArena::Mark arena_mark = (arena != nullptr) ? arena->mark() : WorkerArena::Mark{0, 0};
+        uint64_t trace_id = job.traceId();
+        tp_detail::traceEvent(tp_detail::TraceEventType::Started, trace_id);
+
+        invokeJob(job);
+        job.reset();
+        tp_detail::traceEvent(tp_detail::TraceEventType::Finished, trace_id);
+        if (arena != nullptr) {
+            arena->rewind(arena_mark);
+        }
+        completeJobs(1);
+    }
+
+
+    // Call a job, passing anything it throws to the error handler rather than letting it take down the thread
+    // Jobs from submit(), TaskGroups and parallel loops catch their own exceptions, so this is only for plain jobs.
+    void invokeJob(Job& job) {
+        try {
+            job();
+        } catch (...) {
+            ++m_job_errors;
+            std::shared_ptr<const ErrorHandler> handler;
+            {
+                std::lock_guard<std::mutex> e_lk(m_error_mutex);
+                handler = m_error_handler;
+            }
+            if (handler) {
+                try {
+                    (*handler)(std::current_exception());
+                } catch (...) {
+                    // nowhere left to send it
+                }
+            }
+        }
+    }
+
+
+    void completeJobs(size_t count) {
+        ssize_t pending_jobs = (m_pending_jobs -= count);
+        if (pending_jobs == 0) {
+            std::lock_guard<std::mutex> m_lk(m_management_mutex);
+            if (m_waiters > 0) {                // if we are wait()ing for all jobs to complete and there
+                m_counter_cv.notify_all();      // are no pending jobs then notify the wait()ing threads.
+            }
+        }
+    }
+
+
+    bool startDrain() {
+        std::lock_guard<std::mutex> m_lk(m_management_mutex);
+        if (m_stopped) {
+            return false;
+        }
+        m_refused_jobs = 0;
+        m_draining = true;
+        return true;
+    }
+
+
+    size_t finishDrain() {
+        stop(false);
+        m_timers.cancelAll();
+        size_t discarded_jobs = clearQueue();
+        m_draining = false;
+        return discarded_jobs + m_refused_jobs;
+    }
+
+
+    // A job added to a TaskGroup, which counts itself as done when it is destroyed, whether it has been run or
+    // cleared from the queue
+    template<typename F>
+    class GroupJob {
+    public:
+        template<typename G>
+        GroupJob(TaskGroup& group, G&& work_func) : m_group(&group), m_func(std::forward<G>(work_func)) {
+            group.jobAdded();
+        }
+
+        GroupJob(GroupJob&& other) noexcept(std::is_nothrow_move_constructible<F>::value) :
+            m_group(other.m_group),
+            m_func(std::move(other.m_func))
+        {
+            other.m_group = nullptr;
+        }
+
+        GroupJob(const GroupJob&) = delete;
+
+        ~GroupJob() {
+            if (m_group != nullptr) {
+                m_group->jobDone();
+            }
+        }
+
+        void operator()() {
+            try {
+                m_func();
+            } catch (...) {
+                m_group->jobFailed(std::current_exception());
+            }
+        }
+
+    private:
+        TaskGroup* m_group;
+        F m_func;
+    };
+
+
+    // TaskGroup::wait() for a group with jobs on pool
+    static void helpTaskGroup(void* pool, TaskGroup& group) {
+        static_cast<BasicThreadPool*>(pool)->waitForTaskGroup(group);
+    }
+
+
+    // Run queued jobs until a task group is done, sleeping if there are none (unless we are a worker)
+    void waitForTaskGroup(TaskGroup& group) {
+        const WorkerContext& context = workerContext();
+        bool on_worker = (context.pool == this);
+        Job job;
+
+        while (group.m_pending > 0) {
+            if (on_worker) {
+                if (tryFetchJob(context.id, job)) {
+                    runJob(context.id, job);
+                } else {
+                    std::this_thread::yield();
+                }
+            } else {
+                if (tryFetchExternalJob(job)) {
+                    runExternalJob(job);
+                } else {
+                    group.sleepUntilDone();
+                }
+            }
+        }
+    }
+
+
+    // Fetch a job for a thread that isn't one of our workers to run, from the queues in priority order, without
+    // blocking. Jobs on worker deques are left to the workers.
+    bool tryFetchExternalJob(Job& job) {
+        if (takeExternalJob(lane(Priority::High), job) || takeExternalJob(lane(Priority::Normal), job) ||
+            takeReadyShardJob(job)) {
+            return true;
+        }
+        size_t partition_count = m_partition_count.load(std::memory_order_acquire);
+        Partition* const* partitions = m_partition_table.load(std::memory_order_acquire);
+        for (size_t i = 0; i < partition_count; ++i) {
+            if (takeExternalJob(partitions[i]->m_queue, job)) {
+                return true;
+            }
+        }
+        for (const auto& node_queue : m_node_queues) {
+            if (takeExternalJob(*node_queue, job)) {
+                return true;
+            }
+        }
+        return takeExternalJob(lane(Priority::Low), job);
+    }
+
+
+    bool takeExternalJob(CountedQueue& queue, Job& job) {
+        if ((queue.queued == 0) || (!queue.queue.tryPop(job))) {
+            return false;
+        }
+        --queue.queued;
+        releaseQueueSpace(1);
+        traceDequeuedJobs(&job, 1);
+        return true;
+    }
+
+
+    template<typename F>
+    void addPartitionJob(Partition& partition, F&& work_func) {
+        Job job(GroupJob<typename std::decay<F>::type>(partition.m_group, std::forward<F>(work_func)));
+        ++m_pending_jobs;
+        pushQueuedJobs(partition.m_queue, &job, 1);
+    }
+
+
+    // A job added with an AffinityKey, which hands its shard on to the next of the shard's jobs once it has run
+    template<typename F>
+    class KeyedJob {
+    public:
+
+        template<typename G>
+        KeyedJob(BasicThreadPool& pool, KeyShard& shard, G&& func) : m_pool(&pool), m_shard(&shard), m_func(std::forward<G>(func)) { }
+
+
+        void operator()() {
+            struct FinishShardJob {
+                BasicThreadPool* pool;
+                KeyShard* shard;
+                ~FinishShardJob() {
+                    pool->finishShardJob(*shard);   // even if the job throws
+                }
+            } finish = {m_pool, m_shard};
+            m_func();
+        }
+
+    private:
+
+        BasicThreadPool* m_pool;
+        KeyShard* m_shard;
+        F m_func;
+    };
+
+
+    // Get the shard for a key, making the shards the first time one is needed
+    KeyShard& keyShard(AffinityKey key) {
+        KeyShard* shards = m_key_shards.load(std::memory_order_acquire);
+        if (shards == nullptr) {
+            std::lock_guard<std::mutex> m_lk(m_management_mutex);
+            if (!m_key_shard_storage) {
+                m_key_shard_storage.reset(new KeyShard[KEY_SHARDS]);
+                for (size_t i = 0; i < KEY_SHARDS; ++i) {
+                    m_key_shard_storage[i].index = i;
+                }
+                m_key_shards.store(m_key_shard_storage.get(), std::memory_order_release);
+            }
+            shards = m_key_shard_storage.get();
+        }
+        return shards[key.hash % KEY_SHARDS];
+    }
+
+
+    // Put a shard that has just become ready on its worker's inbox, or on the shared ready list if that worker is
+    // overloaded or isn't running
+    void scheduleShard(KeyShard& shard) {
+        size_t worker_count = m_worker_count;
+        if (worker_count > 0) {
+            Worker& worker = workerSlot(shard.index % std::min(worker_count, workerSlots()));
+            bool queued = false;
+            {
+                std::lock_guard<std::mutex> d_lk(worker.deque_mutex);
+                if (worker.inbox_open && (worker.inbox_count < KEY_INBOX_LIMIT)) {
+                    worker.inbox.push(&shard);
+                    ++worker.inbox_count;
+                    queued = true;
+                }
+            }
+            if (queued) {
+                if (worker.parked) {
+                    // the worker counts its inbox after saying it is parked, so it has either seen the shard or
+                    // needs waking
+                    wakeWorker(worker, false);
+                }
+                return;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> r_lk(m_ready_mutex);
+            m_ready_shards.push(&shard);
+            ++m_ready_shard_count;
+        }
+        wakeWorkers(1);
+    }
+
+
+    // Start the next job of a shard taken off a ready list, returning false if its jobs have been cleared
+    bool startShardJob(KeyShard& shard, Job& job) {
+        std::lock_guard<std::mutex> k_lk(shard.mutex);
+        if (shard.jobs.empty()) {
+            shard.state = ShardState::Idle;
+            return false;
+        }
+        shard.jobs.popFront(job);
+        shard.state = ShardState::Running;
+        --m_key_queued;
+        traceDequeuedJobs(&job, 1);
+        return true;
+    }
+
+
+    // Schedule the shard again once one of its jobs has run, if it has more
+    void finishShardJob(KeyShard& shard) {
+        bool schedule = false;
+        {
+            std::lock_guard<std::mutex> k_lk(shard.mutex);
+            if (shard.jobs.empty()) {
+                shard.state = ShardState::Idle;
+            } else {
+                shard.state = ShardState::Ready;
+                schedule = true;
+            }
+        }
+        if (schedule) {
+            scheduleShard(shard);
+        }
+    }
+
+
+    // Take the next job of a shard on our own inbox
+    bool takeInboxJob(Worker& worker, Job& job) {
+        while (worker.inbox_count > 0) {
+            KeyShard* shard;
+            {
+                std::lock_guard<std::mutex> d_lk(worker.deque_mutex);
+                shard = worker.inbox.pop();
+                if (shard == nullptr) {
+                    return false;
+                }
+                --worker.inbox_count;
+            }
+            if (startShardJob(*shard, job)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    // Take the next job of a shard on the shared ready list, that any worker can take
+    bool takeReadyShardJob(Job& job) {
+        while (m_ready_shard_count > 0) {
+            KeyShard* shard;
+            {
+                std::lock_guard<std::mutex> r_lk(m_ready_mutex);
+                shard = m_ready_shards.pop();
+                if (shard == nullptr) {
+                    return false;
+                }
+                --m_ready_shard_count;
+            }
+            if (startShardJob(*shard, job)) {
+                return true;
+            }
         }
+        return false;
     }
 
 
-    // Copy Constructor (deleted)
-    ThreadPool(const ThreadPool&) = delete;
+    // Move the shards on a stopping worker's inbox to the shared ready list, for whichever workers are left
+    void closeInbox(Worker& worker) {
+        size_t moved = 0;
+        {
+            std::lock_guard<std::mutex> d_lk(worker.deque_mutex);
+            worker.inbox_open = false;
+            std::lock_guard<std::mutex> r_lk(m_ready_mutex);
+            for (KeyShard* shard = worker.inbox.pop(); shard != nullptr; shard = worker.inbox.pop()) {
+                m_ready_shards.push(shard);
+                ++moved;
+            }
+            worker.inbox_count = 0;
+            m_ready_shard_count += moved;
+        }
+        if (moved > 0) {
+            wakeWorkers(moved);
+        }
+    }
 
 
-    // Destructor
-    ~ThreadPool() {
-        stop();
+    // A job added with a CancellationSource, which is skipped if it has been cancelled by the time it is run
+    template<typename F>
+    class CancellableJob {
+    public:
+        template<typename G>
+        CancellableJob(BasicThreadPool& pool, std::shared_ptr<tp_detail::CancelState> state, G&& work_func) :
+            m_pool(&pool),
+            m_state(std::move(state)),
+            m_func(std::forward<G>(work_func))
+        { }
+
+        void operator()() {
+            if (m_state->isCancelled()) {
+                ++m_pool->m_cancelled_jobs;
+                return;
+            }
+            m_func();
+        }
+
+    private:
+        BasicThreadPool* m_pool;
+        std::shared_ptr<tp_detail::CancelState> m_state;
+        F m_func;
+    };
+
+
+    // Queue jobs from timers that have fallen due, from the timer thread
+    // These never wait for room on the queue, so that the timer thread can't be held up by a stopped pool.
+    static void submitTimerJobs(void* pool, std::vector<Job>& jobs) {
+        BasicThreadPool& self = *static_cast<BasicThreadPool*>(pool);
+        self.m_pending_jobs += jobs.size();
+        self.pushQueuedJobs(self.lane(Priority::Normal), jobs.data(), jobs.size(), false);
     }
 
 
-    // Add a new job to the queue
-    void addJob(std::function<void()> work_func) {
-        std::lock_guard<std::mutex> m_lk(m_management_mutex);
-        ++m_pending_jobs;
-#ifdef VERBOSE
-        std::string msg = "Adding job to queue - There are now " + std::to_string(m_pending_jobs) + " pending jobs.\n";
-        std::cout << msg;
-#endif
-        m_job_queue.emplace(std::make_unique<std::function<void()>>(work_func));
-        m_management_cv.notify_one();
+    // Worker thread runtime loop
+    void workerLoop(size_t id) {
+        Worker& worker = workerSlot(id);
+        if (!worker.cpus.empty()) {
+            tp_detail::pinCurrentThread(worker.cpus);
+        }
+        workerContext() = {this, id};
+        tp_detail::currentArena() = &worker.arena;
+        tp_detail::traceWorkerStarted(this, id);
+        {
+            std::lock_guard<std::mutex> d_lk(worker.deque_mutex);
+            worker.inbox_open = true;
+        }
+        MetricsCounters& metrics = worker.metrics;
+        uint64_t started = MetricsPolicy::enabled ? tp_detail::nowNanoseconds() : 0;
+        metrics.running_since.store(started, std::memory_order_relaxed);
+        Job job;
+
+        while (fetchJob(id, job)) {
+            runJob(id, job);
+        }
+        publishCompletedJobs(worker);
+        closeInbox(worker);
+        workerContext() = {nullptr, 0};
+        tp_detail::currentArena() = nullptr;
+        if (MetricsPolicy::enabled) {
+            addToCounter(metrics.running_ns, tp_detail::nowNanoseconds() - started);
+            metrics.running_since.store(0, std::memory_order_relaxed);
+        }
     }
     
 
-    // Start the threadpool
-    // Set worker_count = 0 to use one thread per hardware supported thread
-    bool start(size_t worker_count) {
-        std::lock_guard<std::mutex> m_lk(m_management_mutex);
+#ifdef __cpp_impl_coroutine
 
-        if (!m_stopped) {
-            return false;
-        } else {
-            m_stopped = false;
-            
-            // create worker threads
-            if (worker_count == 0) {
-                worker_count = std::thread::hardware_concurrency();
+    template<typename T>
+    tp_detail::DetachedCoroutine runSpawnedTask(Task<T> task, std::promise<T> promise) {
+        co_await schedule();
+        try {
+            if constexpr (std::is_void<T>::value) {
+                co_await task;
+                promise.set_value();
+            } else {
+                promise.set_value(co_await task);
             }
-            for (size_t id = 0; id < worker_count; ++id) {
-                m_worker_threads.emplace_back(std::make_unique<std::thread>(&ThreadPool::workerLoop, this, id));
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+        }
+    }
+
+#endif
+
+
+    // Shared state of a parallelFor() or parallelReduce(), which lives on the calling thread's stack
+    template<typename Index, typename T, typename Body, typename Combine>
+    struct ParallelLoop {
+        ParallelLoop(Body& loop_body, Combine& loop_combine, const T& loop_identity, size_t loop_grain) :
+            body(loop_body),
+            combine(loop_combine),
+            identity(loop_identity),
+            result(loop_identity),
+            grain(loop_grain),
+            outstanding(1),
+            cancelled(false)
+        { }
+
+        Body& body;
+        Combine& combine;
+        const T& identity;
+        T result;
+        const size_t grain;
+        std::atomic<size_t> outstanding;    // loop jobs queued or running, only decremented with mutex held
+        std::atomic<bool> cancelled;
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable done_cv;
+    };
+
+
+    template<typename Index, typename T, typename Body, typename Combine>
+    T runParallelLoop(Index begin, Index end, const T& identity, Body& body, Combine& combine, size_t grain) {
+        if (!(begin < end)) {
+            return identity;
+        }
+        if (grain == 0) {
+            size_t worker_count = std::thread::hardware_concurrency();
+            grain = static_cast<size_t>(end - begin) / (((worker_count > 0) ? worker_count : 1) * LOOP_CHUNKS_PER_WORKER);
+            grain = (grain > 0) ? grain : 1;
+        }
+
+        using Loop = ParallelLoop<Index, T, Body, Combine>;
+        Loop loop(body, combine, identity, grain);
+
+        const WorkerContext& context = workerContext();
+        if (m_stopped || (context.pool == this)) {
+            runLoopJob(loop, begin, end);   // split off from here onto the queue, if there are workers to run the halves
+        } else {
+            addJob(LoopJob<Loop, Index>(*this, loop, begin, end));
+        }
+
+        if (context.pool == this) {
+            // we are a worker, so help out rather than blocking while the rest of the loop is waiting to run
+            Job job;
+            while (loop.outstanding > 0) {
+                if (tryFetchJob(context.id, job)) {
+                    runJob(context.id, job);
+                } else {
+                    std::this_thread::yield();
+                }
             }
-            
-            return true;
         }
-        
+
+        std::unique_lock<std::mutex> l_lk(loop.mutex);
+        loop.done_cv.wait(l_lk, [&loop](){ return (loop.outstanding == 0); });
+        if (loop.error) {
+            std::rethrow_exception(loop.error);
+        }
+        return std::move(loop.result);
     }
-    
 
-    // Stop the threadpool
-    // Call to stop() will block until all running jobs have finished and been join()ed, set clear_queue = false
-    // to leave pending jobs on the queue or clear_queue = true to delete pending jobs.
-    bool stop(bool clear_queue = true) {
-        {
-            std::lock_guard<std::mutex> m_lk(m_management_mutex);
 
-            if (m_stopped) {
-                return false;
-            } else {
-                m_stopped = true;
-                if (clear_queue) {
-                    m_job_queue = {};
+    // Run [begin, end) of a parallel loop, splitting off the upper half as a new job whenever a worker is idle
+    template<typename Loop, typename Index>
+    void runLoopJob(Loop& loop, Index begin, Index end) {
+        auto partial = loop.identity;
+
+        try {
+            while ((begin < end) && (!loop.cancelled)) {
+                size_t remaining = static_cast<size_t>(end - begin);
+                if ((remaining > loop.grain) && (m_idle_workers > 0)) {
+                    Index middle = begin + static_cast<Index>(remaining / 2);
+                    ++loop.outstanding;
+                    addJob(LoopJob<Loop, Index>(*this, loop, middle, end));     // which counts itself out if it throws
+                    end = middle;
+                } else {
+                    Index chunk_end = (remaining > loop.grain) ? begin + static_cast<Index>(loop.grain) : end;
+                    for (; begin < chunk_end; ++begin) {
+                        partial = loop.combine(std::move(partial), loop.body(begin));
+                    }
                 }
             }
-            m_management_cv.notify_all();   // wake any sleeping worker threads
+        } catch (...) {
+            failLoop(loop, std::current_exception());
         }
-        // join all delete all worker threads
-        for (const auto& thread_ptr : m_worker_threads) {
-            thread_ptr->join();
+
+        std::lock_guard<std::mutex> l_lk(loop.mutex);
+        if (!loop.cancelled) {
+            loop.result = loop.combine(std::move(loop.result), std::move(partial));
+        }
+        if (--loop.outstanding == 0) {
+            loop.done_cv.notify_one();
+        }
+    }
+
+
+    // Skip the rest of a parallel loop, to rethrow error (unless it already has an error) once it has stopped
+    template<typename Loop>
+    static void failLoop(Loop& loop, std::exception_ptr error) {
+        loop.cancelled = true;
+        std::lock_guard<std::mutex> l_lk(loop.mutex);
+        if (!loop.error) {
+            loop.error = std::move(error);
         }
-        m_worker_threads.clear();
-        
-        return true;
     }
+
+
+    // A job running part of a parallel loop, which fails the loop as it is destroyed if it hasn't been run, so that
+    // a chunk cleared from the queue leaves the loop's caller with an error rather than waiting for it forever
+    template<typename Loop, typename Index>
+    class LoopJob {
+    public:
+        LoopJob(BasicThreadPool& pool, Loop& loop, Index begin, Index end) : m_pool(&pool), m_loop(&loop), m_begin(begin), m_end(end) { }
+
+        LoopJob(LoopJob&& other) noexcept : m_pool(other.m_pool), m_loop(other.m_loop), m_begin(other.m_begin), m_end(other.m_end) {
+            other.m_loop = nullptr;
+        }
+
+        LoopJob(const LoopJob&) = delete;
+
+        ~LoopJob() {
+            if (m_loop != nullptr) {
+                failLoop(*m_loop, std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+                std::lock_guard<std::mutex> l_lk(m_loop->mutex);
+                if (--m_loop->outstanding == 0) {
+                    m_loop->done_cv.notify_one();
+                }
+            }
+        }
+
+        void operator()() {
+            Loop* loop = m_loop;
+            m_loop = nullptr;
+            m_pool->runLoopJob(*loop, m_begin, m_end);
+        }
+
+    private:
+        BasicThreadPool* m_pool;
+        Loop* m_loop;
+        Index m_begin;
+        Index m_end;
+    };
+
+
+    // Worker::node of a worker that isn't placed on a particular NUMA node
+    static constexpr size_t NO_NODE = static_cast<size_t>(-1);
+
+    // Chunks per hardware thread that a parallel loop is divided into when picking a grain automatically
+    static constexpr size_t LOOP_CHUNKS_PER_WORKER = 64;
+
+    // Worker slots the first slot table has room for
+    static constexpr size_t MIN_WORKER_CAPACITY = 16;
+
+    // Jobs queued per job timed on the queue for WorkerMetrics::queue_wait
+    static constexpr size_t QUEUE_WAIT_SAMPLE_INTERVAL = 16;
+
+
+    // Class data
+    std::atomic<bool> m_stopped;
+    size_t m_waiters;                       // threads in wait(), only touched with m_management_mutex held
+    std::atomic<bool> m_draining;
+    std::atomic<size_t> m_refused_jobs;     // while draining
+    const bool m_work_stealing;
+    IdleStrategy m_idle_strategy;
+    IdlePolicy m_idle_policy;
+    WorkerPlacement m_placement;
+    WorkerScaling m_scaling;
+
+    tp_detail::TimerService m_timers;      // before the queues, as periodic timers' jobs refer to it
     
+    CountedQueue m_lanes[PRIORITY_LEVELS];
+    std::vector<std::unique_ptr<CountedQueue>> m_node_queues;  // one per NUMA node
 
-    // Check if worker threads are running
-    bool isStopped() {
-        return m_stopped;
+    // Key shards are made the first time they are needed, with m_management_mutex held, and never move
+    std::unique_ptr<KeyShard[]> m_key_shard_storage;
+    std::atomic<KeyShard*> m_key_shards;
+    std::atomic<size_t> m_key_queued;       // keyed jobs waiting on their shards
+    std::mutex m_ready_mutex;
+    ReadyShards m_ready_shards;             // shards with jobs that any worker can take
+    std::atomic<size_t> m_ready_shard_count;
+
+    // Partitions are only ever added, with m_management_mutex held, with the table of them replaced each time
+    std::vector<std::unique_ptr<Partition>> m_partition_storage;
+    std::vector<std::unique_ptr<Partition*[]>> m_partition_tables;
+    std::atomic<Partition**> m_partition_table;
+    std::atomic<size_t> m_partition_count;
+
+    // Worker slots are only ever added (with m_management_mutex held) and never move, so that workers can look each
+    // other up without a lock. The table of slots is replaced as it fills up, and old tables are kept until the pool
+    // is destroyed as a worker may still be looking at one.
+    std::vector<std::unique_ptr<Worker>> m_worker_storage;
+    std::vector<std::unique_ptr<Worker*[]>> m_worker_tables;
+    std::atomic<size_t> m_worker_slots;
+    size_t m_worker_capacity;
+    std::atomic<Worker**> m_worker_table;
+
+    std::atomic<size_t> m_worker_count;     // Running workers
+    std::atomic<size_t> m_max_workers;      // most workers an elastic pool will scale up to, 0 if not elastic
+    std::atomic<size_t> m_scaling_queue_depth;
+    std::atomic<size_t> m_queued_jobs;      // jobs on all queues and worker deques
+    std::atomic<size_t> m_deque_jobs;       // jobs on worker deques, so that workers only go stealing when there are some
+    std::atomic<size_t> m_idle_workers;     // asleep on their parking slots, or about to be
+    std::atomic<uint64_t> m_idle_stack;     // see pushIdleWorker()
+    std::atomic<size_t> m_dequeue_batch;    // most jobs a worker takes off a queue at once
+
+    std::atomic<size_t> m_queue_capacity;   // 0 for no limit
+    std::atomic<size_t> m_space_watermark;  // producers waiting for room are woken once there are this few jobs
+    std::atomic<size_t> m_space_waiters;
+    std::mutex m_space_mutex;
+    std::condition_variable m_space_cv;
+
+    std::mutex m_management_mutex;
+
+    std::atomic<ssize_t> m_pending_jobs;
+    std::condition_variable m_counter_cv;
+
+    std::shared_ptr<tp_detail::StateSlab> m_state_slab;    // shared with the futures returned by submit()
+
+    std::atomic<uint64_t> m_job_errors;
+    std::atomic<uint64_t> m_cancelled_jobs;
+    std::mutex m_error_mutex;
+    std::shared_ptr<const ErrorHandler> m_error_handler;    // copied out under m_error_mutex to call it
+    
+};
+
+
+// A queue of its own for a subsystem, with its jobs counted by a task group for wait() and pendingJobs()
+template<typename QueuePolicy, typename IdlePolicy, typename MetricsPolicy>
+class BasicThreadPool<QueuePolicy, IdlePolicy, MetricsPolicy>::Partition {
+public:
+
+    Partition(const Partition&) = delete;
+
+
+    // Add a new job to the partition's queue, see BasicThreadPool::addJob(work_func)
+    // Jobs added from the pool's own jobs go on the partition's queue too, rather than a worker's deque.
+    template<typename F>
+    void addJob(F&& work_func) {
+        m_pool->addPartitionJob(*this, std::forward<F>(work_func));
     }
 
 
-    // Get the count of queued and running jobs
+    // Block until every job added to the partition has finished, helping to run jobs meanwhile
+    // As with TaskGroup::wait(), the first exception thrown by any of the jobs is rethrown.
+    void wait() {
+        m_group.wait();
+    }
+
+
+    // Get the number of the partition's jobs that are queued or running
     size_t pendingJobs() {
-        std::unique_lock<std::mutex> m_lk(m_management_mutex);
-        return m_pending_jobs;
+        return m_group.pendingJobs();
     }
 
 
-    // Get the count of queued jobs
-    size_t queuedJobs() {
-        std::unique_lock<std::mutex> m_lk(m_management_mutex);
-        return m_job_queue.size();
+    size_t weight() const {
+        return m_weight;
     }
 
+private:
 
-    // Get the count of running jobs
-    size_t runningJobs() {
-        std::unique_lock<std::mutex> m_lk(m_management_mutex);
-        return m_pending_jobs - m_job_queue.size();
+    friend class BasicThreadPool;
+
+
+    Partition(BasicThreadPool& pool, size_t weight) : m_pool(&pool), m_weight(weight) { }
+
+
+    BasicThreadPool* m_pool;
+    const size_t m_weight;
+    TaskGroup m_group;
+    CountedQueue m_queue;       // destroyed first, as its jobs count themselves done in m_group
+};
+
+
+// An instance of T for each worker of a pool, and for each other thread that uses it
+// local() gives the calling thread its own instance, which no other thread touches until the jobs using it are
+// done. Then (eg after wait()) combine() or forEach() visit every instance, so that a count can be taken by each
+// worker and merged at the end rather than all of them hammering one atomic. Instances are padded apart so that
+// they don't share cache lines, and are created as workers first use them, starting as copies of initial.
+template<typename QueuePolicy, typename IdlePolicy, typename MetricsPolicy>
+template<typename T>
+class BasicThreadPool<QueuePolicy, IdlePolicy, MetricsPolicy>::WorkerLocal {
+public:
+
+    explicit WorkerLocal(BasicThreadPool& pool, T initial = T()) :
+        m_pool(pool),
+        m_initial(std::move(initial)),
+        m_table(nullptr),
+        m_size(0)
+    {
+        std::lock_guard<std::mutex> w_lk(m_mutex);
+        grow(m_pool.workerSlots());
     }
-    
 
-    // Wait for all pending jobs to complete
-    void wait() {
-        std::unique_lock<std::mutex> m_lk(m_management_mutex);
 
-        if (m_pending_jobs > 0) {
-            m_waiting = true;
+    WorkerLocal(const WorkerLocal&) = delete;
 
-            m_counter_cv.wait(m_lk, [this](){ return (m_pending_jobs == 0); });
-            m_waiting = false;
+
+    // Get the calling thread's instance, without a lock if the caller is one of the pool's workers
+    // Threads that aren't (such as one running jobs while in TaskGroup::wait()) have an instance each as well.
+    T& local() {
+        ssize_t index = m_pool.currentWorkerIndex();
+        if (index < 0) {
+            return externalInstance();
+        }
+        size_t id = static_cast<size_t>(index);
+        if (id >= m_size.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> w_lk(m_mutex);
+            grow(id + 1);
         }
+        return m_table.load(std::memory_order_acquire)[id]->value;
     }
 
 
-    // Clear the job queue and return the number of cleared jobs
-    size_t clearQueue() {
-        std::lock_guard<std::mutex> m_lk(m_management_mutex);
+    // Merge every instance, as result = combine(result, instance) starting from initial
+    template<typename Combine>
+    T combine(Combine combine_func) {
+        T result = m_initial;
+        forEach([&result, &combine_func](T& value){ result = combine_func(std::move(result), value); });
+        return result;
+    }
 
-        size_t queued_jobs_cleared = m_job_queue.size();
-        m_pending_jobs -= queued_jobs_cleared;
-        m_job_queue = {};
 
-        return queued_jobs_cleared;
+    // Call func(instance) for each instance, which mustn't be in use by a running job
+    template<typename F>
+    void forEach(F&& func) {
+        std::lock_guard<std::mutex> w_lk(m_mutex);
+        for (const auto& instance : m_workers) {
+            func(instance->value);
+        }
+        for (const auto& external : m_externals) {
+            func(external.second->value);
+        }
+    }
+
+
+    // Set every instance back to initial, which mustn't be in use by a running job
+    void reset() {
+        forEach([this](T& value){ value = m_initial; });
     }
 
 private:
 
-    // Worker thread runtime loop
-    void workerLoop(size_t id) {
-#ifdef VERBOSE
-        std::string msg = "Worker " + std::to_string(id) + " started.\n";
-        std::cout << msg;
-#endif
-        std::unique_ptr<std::function<void()>> job;
+    struct Instance {
+        explicit Instance(const T& initial) : value(initial) { }
 
-        while(true) {
-            {
-                std::unique_lock<std::mutex> m_lk(m_management_mutex);
-                m_management_cv.wait(m_lk, [this](){ return ((!m_job_queue.empty()) || (m_stopped)); });
-                
-                if (!m_stopped) {
-                    job.reset(m_job_queue.front().release());   // fetch a job from the queue
-                    m_job_queue.pop();                          // immediately delete remaining invalid ptr
-#ifdef VERBOSE
-                    msg = "Worker " + std::to_string(id) + " starting job.\n";
-                    std::cout << msg;
-#endif
-                } else {
-                    break;
-                }
+        char pad_before[tp_detail::CACHE_LINE_SIZE];
+        T value;
+        char pad_after[tp_detail::CACHE_LINE_SIZE];
+    };
+
+
+    // Add instances up to size, m_mutex must be held
+    // Workers read the table without a lock, so it is replaced rather than changed, and old ones are kept.
+    void grow(size_t size) {
+        size_t old_size = m_size.load(std::memory_order_relaxed);
+        if (size <= old_size) {
+            return;
+        }
+        std::unique_ptr<Instance*[]> table(new Instance*[size]);
+        for (size_t id = 0; id < size; ++id) {
+            if (id == m_workers.size()) {
+                m_workers.emplace_back(new Instance(m_initial));
+            }
+            table[id] = m_workers[id].get();
+        }
+        m_table.store(table.get(), std::memory_order_release);
+        m_tables.push_back(std::move(table));
+        m_size.store(size, std::memory_order_release);
+    }
+
+
+    T& externalInstance() {
+        std::thread::id thread_id = std::this_thread::get_id();
+        std::lock_guard<std::mutex> w_lk(m_mutex);
+        for (const auto& external : m_externals) {
+            if (external.first == thread_id) {
+                return external.second->value;
             }
+        }
+        m_externals.emplace_back(thread_id, std::unique_ptr<Instance>(new Instance(m_initial)));
+        return m_externals.back().second->value;
+    }
 
-            (*job)();   // run the job and return the result via callback
 
-            {
-                std::lock_guard<std::mutex> m_lk(m_management_mutex);
-                --m_pending_jobs;
-#ifdef VERBOSE
-                msg = "Worker " + std::to_string(id) + " finished - There are now " + std::to_string(m_pending_jobs) + " pending jobs.\n";
-                std::cout << msg;
-#endif
-                if ((m_pending_jobs == 0) && (m_waiting)) { // if we are wait()ing for all jobs to complete and there
-                    m_counter_cv.notify_one();              // are no pending jobs then notify the wait()ing thread.
+    BasicThreadPool& m_pool;
+    const T m_initial;
+
+    std::mutex m_mutex;     // held to add instances, or visit them all
+    std::vector<std::unique_ptr<Instance>> m_workers;
+    std::vector<std::unique_ptr<Instance*[]>> m_tables;
+    std::atomic<Instance**> m_table;
+    std::atomic<size_t> m_size;
+    std::vector<std::pair<std::thread::id, std::unique_ptr<Instance>>> m_externals;
+};
+
+
+// A stream of jobs that run one at a time, in the order they were added, on a pool's workers, eg:
+//     ThreadPool::Strand socket_writes(pool);
+//     socket_writes.addJob(write_func_1);
+//     socket_writes.addJob(write_func_2);     // starts once write_func_1 has finished, on any worker
+// A strand has no thread of its own, so any number of them can share a pool. Jobs are pushed onto a lock-free
+// intrusive MPSC list, and the add that finds the strand empty queues a single job on the pool to run them. That job
+// runs up to RUN_LIMIT of them before queueing itself again behind the pool's other jobs, so a busy strand can't
+// keep a worker to itself. Jobs added by a strand's own jobs run after the job adding them, as with any other.
+template<typename QueuePolicy, typename IdlePolicy, typename MetricsPolicy>
+class BasicThreadPool<QueuePolicy, IdlePolicy, MetricsPolicy>::Strand {
+public:
+
+    static constexpr size_t RUN_LIMIT = 32;
+
+
+    explicit Strand(BasicThreadPool& pool) : m_pool(pool), m_tail(&m_stub), m_head(&m_stub), m_size(0) {
+        m_stub.next = nullptr;
+    }
+
+
+    Strand(const Strand&) = delete;
+
+
+    // Waits for the strand's jobs, without rethrowing
+    ~Strand() {
+        m_group.waitForJobs();
+    }
+
+
+    // Add a new job to the end of the strand
+    template<typename F>
+    void addJob(F&& work_func) {
+        Job job(std::forward<F>(work_func));
+        void* block = tp_detail::JobBlocks::allocate(sizeof(Node), alignof(Node));
+        Node* node = ::new (block) Node();
+        node->job = std::move(job);
+        push(node);
+        if (m_size++ == 0) {
+            addRunner();    // the strand was empty, so no runner is queued or running to see this job
+        }
+    }
+
+
+    // Block until every job added to the strand has finished, helping to run jobs meanwhile
+    // As with TaskGroup::wait(), the first exception thrown by any of the jobs is rethrown.
+    void wait() {
+        m_group.wait();
+    }
+
+
+    // Get the number of the strand's jobs that are waiting or running
+    size_t pendingJobs() {
+        return m_size;
+    }
+
+private:
+
+    struct Node {
+        std::atomic<Node*> next;
+        Job job;
+    };
+
+
+    // The job queued on the pool to run the strand's jobs, which throws them away instead if it is cleared unrun
+    class Runner {
+    public:
+
+        explicit Runner(Strand& strand) noexcept : m_strand(&strand) { }
+
+
+        Runner(Runner&& other) noexcept : m_strand(other.m_strand) {
+            other.m_strand = nullptr;
+        }
+
+
+        ~Runner() {
+            if (m_strand != nullptr) {
+                m_strand->runJobs(false);
+                m_strand->m_group.jobDone();
+            }
+        }
+
+
+        void operator()() {
+            Strand* strand = m_strand;
+            m_strand = nullptr;
+            strand->runJobs(true);
+            strand->m_group.jobDone();
+        }
+
+    private:
+
+        Strand* m_strand;
+    };
+
+
+    void addRunner() {
+        m_group.m_help = &BasicThreadPool::helpTaskGroup;
+        m_group.m_pool = &m_pool;
+        m_group.jobAdded();
+        m_pool.addJob(Runner(*this));
+    }
+
+
+    // Run (or throw away) jobs until the strand is empty, or RUN_LIMIT of them have run and we go to the back of
+    // the pool's queue
+    void runJobs(bool run) {
+        for (size_t ran = 1; ; ++ran) {
+            Node* node = pop();
+            while (node == nullptr) {
+                std::this_thread::yield();  // m_size says there is one, still being linked in by its producer
+                node = pop();
+            }
+            if (run) {
+                try {
+                    node->job();
+                } catch (...) {
+                    m_group.jobFailed(std::current_exception());
                 }
             }
+            node->~Node();
+            tp_detail::JobBlocks::deallocate(node, sizeof(Node), alignof(Node));
+
+            if (m_size-- == 1) {
+                return;     // empty, so the next job added will add a runner
+            }
+            if (run && (ran == RUN_LIMIT)) {
+                addRunner();
+                return;
+            }
         }
-#ifdef VERBOSE
-        msg = "Worker " + std::to_string(id) + " stopped.\n";
-        std::cout << msg;
-#endif
     }
-    
 
-    // Class data
-    bool m_stopped;
-    bool m_waiting;
-    
-    std::queue<std::unique_ptr<std::function<void()>>> m_job_queue;
-    std::vector<std::unique_ptr<std::thread>> m_worker_threads;
 
-    std::mutex m_management_mutex;
-    std::condition_variable m_management_cv;
+    // Push a node onto the list, from any thread (Vyukov's intrusive MPSC queue)
+    void push(Node* node) {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        Node* prev = m_tail.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
 
-    ssize_t m_pending_jobs;
-    std::condition_variable m_counter_cv;
-    
+
+    // Pop the oldest node off the list, from the one runner, or nullptr if it is still being pushed
+    Node* pop() {
+        Node* head = m_head;
+        Node* next = head->next.load(std::memory_order_acquire);
+        if (head == &m_stub) {
+            if (next == nullptr) {
+                return nullptr;
+            }
+            m_head = next;
+            head = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr) {
+            m_head = next;
+            return head;
+        }
+        if (head != m_tail.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        push(&m_stub);      // so that head can be popped without leaving the list empty
+        next = head->next.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            m_head = next;
+            return head;
+        }
+        return nullptr;
+    }
+
+
+    BasicThreadPool& m_pool;
+    TaskGroup m_group;              // counts the runner, if there is one
+    Node m_stub;
+    std::atomic<Node*> m_tail;      // pushed onto by producers...
+    Node* m_head;                   // ...and popped from by the runner
+    std::atomic<size_t> m_size;     // jobs added and not yet finished
 };
+
+
+// The default thread pool, with an unbounded mutex-protected queue
+using ThreadPool = BasicThreadPool<UnboundedQueue>;
@@ -20,7 +20,7 @@
 
 
 // to compile, link against libpthread, eg:
-// $ g++ -std=c++14 examples.cpp -o2 -DVERBOSE -o examples -lpthread
+// $ g++ -std=c++14 examples.cpp -o2 -o examples -lpthread
 
 
 # include "cpp-tp.hpp"
@@ -34,6 +34,8 @@
 #include <algorithm>
 #include <numeric>
 #include <functional>
+#include <future>
+#include <atomic>
 
 
 const int MIN_WORK_DURATION_MSEC = 500;
@@ -150,6 +152,45 @@ int main(int argc, char** argv) {
     tp.addJob(work_func_10);
     
     tp.wait();
+
+
+    // Example 3 - get the result back through a future instead of a callback
+    std::cout << std::endl << "Example 3." << std::endl << std::endl;
+
+    // submit() moves (or copies) the callable and its arguments into the job, like std::async()
+    std::future<int> result_1 = tp.submit([&tc](std::vector<int> inputs){ return tc->workFunc(inputs); }, arg_1);
+    std::future<int> result_2 = tp.submit([&tc](std::vector<int> inputs){ return tc->workFunc(inputs); }, arg_5);
+    std::future<std::unique_ptr<TestClass::ResultType>> result_3 = tp.submit([&tc, &arg_3](){ return tc->workFunc2(arg_3); });
+
+    // get() blocks until the job has completed
+    tc->onCompletion(result_1.get());
+    tc->onCompletion(result_2.get());
+    tc->onCompletion2(result_3.get());
+
+
+    // Example 4 - look at what the workers have been doing
+    std::cout << std::endl << "Example 4." << std::endl << std::endl;
+
+    // snapshot() can be called at any time, without stopping the workers
+    PoolMetrics metrics = tp.snapshot();
+    for (size_t i = 0; i < metrics.workers.size(); ++i) {
+        const WorkerMetrics& worker = metrics.workers[i];
+        std::cout << "Worker " << i << " ran " << worker.jobs_executed << " jobs, busy for " << (worker.busy_ns / 1000000)
+                  << " ms and idle for " << (worker.idle_ns / 1000000) << " ms" << std::endl;
+    }
+    std::cout << "Most jobs waiting at once: " << metrics.total.peak_queue_depth << std::endl;
+
+
+    // Example 5 - delayed and periodic jobs, without a worker sleeping until they are due
+    std::cout << std::endl << "Example 5." << std::endl << std::endl;
+
+    std::atomic<int> ticks(0);
+    TimerId ticker = tp.addJobEvery(std::chrono::milliseconds(100), [&ticks](){ std::cout << "Tick " << ++ticks << std::endl; });
+    tp.addJobAfter(std::chrono::milliseconds(450), [&tp, ticker](){ tp.cancelTimer(ticker); std::cout << "Ticker cancelled" << std::endl; });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    tp.wait();
+
     tp.stop();  // stop the threadpool, delete all threads
     // stop(bool clear_queue = true) will wait for all running jobs to complete, pending jobs
     // on the queue will be deleted unless clear_queue = false.
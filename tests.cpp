@@ -0,0 +1,741 @@
+// MIT No Attribution
+
+// Copyright 2024 Dr Seb N.F. Sikora
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this
+// software and associated documentation files (the "Software"), to deal in the Software
+// without restriction, including without limitation the rights to use, copy, modify,
+// merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+// INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+// PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+// Tests for cpp-tp.hpp (scroll down to main() for the list)
+
+
+// to compile, link against libpthread, eg:
+// $ g++ -std=c++14 -O2 tests.cpp -o tests -lpthread
+// and again as C++20 to include the coroutine tests:
+// $ g++ -std=c++20 -O2 tests.cpp -o tests -lpthread
+//
+// $ ./tests                  run every test
+// $ ./tests name...          run the named tests only
+//
+// The exit status is the number of tests that failed. A test that doesn't finish within TEST_TIMEOUT is taken to
+// have deadlocked, and ends the run. The tests are worth running under -fsanitize=address,undefined and
+// -fsanitize=thread too.
+
+
+# include "cpp-tp.hpp"
+
+
+#include <vector>
+#include <list>
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+
+
+const std::chrono::seconds TEST_TIMEOUT(30);
+
+
+// Checks failed by the test that is running
+int g_failed_checks = 0;
+
+
+#define CHECK(condition) checkCondition((condition), #condition, __FILE__, __LINE__)
+
+
+void checkCondition(bool passed, const char* condition, const char* file, int line) {
+    if (!passed) {
+        ++g_failed_checks;
+        std::cerr << file << ":" << line << ": CHECK(" << condition << ") failed" << std::endl;
+    }
+}
+
+
+// An address the compiler can't see through, so that alignment checks aren't folded away
+__attribute__((noinline)) uintptr_t opaqueAddress(const void* ptr) {
+    uintptr_t address = reinterpret_cast<uintptr_t>(ptr);
+    asm volatile("" : "+r"(address));
+    return address;
+}
+
+
+// Keep a pool's only worker busy until the gate is opened, so that jobs queued meanwhile stay queued
+class Gate {
+public:
+    template<typename Pool>
+    explicit Gate(Pool& pool) : m_state(std::make_shared<State>()) {
+        std::shared_ptr<State> state = m_state;
+        pool.addJob([state](){
+            state->started = true;
+            while (!state->open) {
+                std::this_thread::yield();
+            }
+        });
+        while (!m_state->started) {
+            std::this_thread::yield();
+        }
+    }
+
+    ~Gate() {
+        open();
+    }
+
+    void open() {
+        m_state->open = true;
+    }
+
+private:
+    // Shared with the job, which may still be running when the gate goes out of scope
+    struct State {
+        std::atomic<bool> started{false};
+        std::atomic<bool> open{false};
+    };
+
+    std::shared_ptr<State> m_state;
+};
+
+
+// Start draining a pool on another thread, returning once it is refusing jobs
+template<typename Pool>
+std::thread startDrain(Pool& pool, size_t& refused) {
+    std::thread drainer([&pool, &refused](){ refused = pool.drain(); });
+    while (pool.tryAddJob([](){ })) {
+        std::this_thread::yield();
+    }
+    return drainer;
+}
+
+
+// A queue policy that throws from its next push once armed
+std::atomic<bool> g_throw_on_push(false);
+
+class ThrowingQueue : public UnboundedQueue {
+public:
+    bool tryPush(Job& job) {
+        throwIfArmed();
+        return UnboundedQueue::tryPush(job);
+    }
+
+    size_t tryPushBulk(Job* jobs, size_t count) {
+        throwIfArmed();
+        return UnboundedQueue::tryPushBulk(jobs, count);
+    }
+
+private:
+    static void throwIfArmed() {
+        if (g_throw_on_push.exchange(false)) {
+            throw std::runtime_error("push failed");
+        }
+    }
+};
+
+
+// Jobs adding jobs, three levels deep, through the normal queue, a priority lane and a partition
+template<typename Pool>
+void jobsAddingJobs(bool work_stealing) {
+    Pool pool(true, 4, work_stealing);
+    std::atomic<int> ran(0);
+    typename Pool::Partition& partition = pool.addPartition(2);
+
+    for (int i = 0; i < 2000; ++i) {
+        pool.addJob([&](){
+            for (int j = 0; j < 5; ++j) {
+                pool.addJob([&](){ ++ran; });
+            }
+            ++ran;
+        });
+    }
+    pool.wait();
+    CHECK(ran == 12000);
+
+    for (int i = 0; i < 200; ++i) {
+        pool.addJob([&](){
+            for (int j = 0; j < 5; ++j) {
+                pool.addJob([&](){
+                    for (int k = 0; k < 5; ++k) {
+                        pool.addJob([&](){ ++ran; }, Priority::High);
+                        partition.addJob([&](){ ++ran; });
+                    }
+                });
+            }
+        });
+    }
+    pool.wait();
+    CHECK(ran == 22000);
+    CHECK(pool.pendingJobs() == 0);
+}
+
+
+void jobsAddingJobsUnbounded() {
+    jobsAddingJobs<ThreadPool>(false);
+    jobsAddingJobs<ThreadPool>(true);
+}
+
+
+void jobsAddingJobsBoundedMpmc() {
+    jobsAddingJobs<BasicThreadPool<BoundedMpmcQueue<64>>>(false);
+    jobsAddingJobs<BasicThreadPool<BoundedMpmcQueue<64>>>(true);
+    jobsAddingJobs<BasicThreadPool<BoundedMpmcQueue<2>>>(false);
+}
+
+
+// A job that waits on a job queued after it, which may have been taken off the queue in the same batch
+void batchedJobsDontWaitOnEachOther() {
+    for (int work_stealing = 0; work_stealing < 2; ++work_stealing) {
+        ThreadPool pool(false, 0, work_stealing != 0);
+        std::promise<void> promise;
+        std::shared_future<void> future = promise.get_future().share();
+        std::atomic<int> ran(0);
+        pool.addJob([future, &ran](){ future.wait(); ++ran; });
+        pool.addJob([&promise, &ran](){ promise.set_value(); ++ran; });
+        for (int i = 0; i < 126; ++i) {
+            pool.addJob([&ran](){ ++ran; });
+        }
+        pool.start(4);
+        pool.wait();
+        CHECK(ran == 128);
+    }
+}
+
+
+// clearQueue() discards every queued job, including those a worker has taken off the queue in a batch
+void clearQueueDiscardsQueuedJobs() {
+    for (int work_stealing = 0; work_stealing < 2; ++work_stealing) {
+        ThreadPool pool(true, 1, work_stealing != 0);
+        std::atomic<int> ran(0);
+        {
+            Gate gate(pool);
+            for (int i = 0; i < 400; ++i) {
+                pool.addJob([&ran](){ ++ran; });
+            }
+            CHECK(pool.clearQueue() == 400);
+        }
+        pool.wait();
+        CHECK(ran == 0);
+        CHECK(pool.pendingJobs() == 0);
+    }
+}
+
+
+// A non-started pool with a full bounded queue turns jobs away rather than waiting for room
+void tryAddJobOnFullQueue() {
+    BasicThreadPool<BoundedMpmcQueue<2>> pool(false, 1);
+    std::atomic<int> ran(0);
+    auto job = [&ran](){ ++ran; };
+    CHECK(pool.tryAddJob(job));
+    CHECK(pool.tryAddJob(job));
+    CHECK(!pool.tryAddJob(job));
+    CHECK(!pool.addJobFor(std::chrono::milliseconds(20), job));
+    pool.start(1);
+    pool.wait();
+    CHECK(ran == 2);
+    CHECK(pool.tryAddJob(job));
+    pool.wait();
+    CHECK(ran == 3);
+}
+
+
+// While draining, jobs from outside of the pool are refused, however they are added, and jobs added by running
+// jobs still run
+void drainRefusesExternalJobs() {
+    ThreadPool pool(true, 1);
+    std::atomic<int> outside(0);
+    std::atomic<int> inside(0);
+    std::atomic<bool> go(false);
+    pool.addJob([&](){
+        while (!go) {
+            std::this_thread::yield();
+        }
+        for (int i = 0; i < 3; ++i) {
+            pool.addJob([&inside](){ ++inside; });
+            pool.addJob(AffinityKey::of(i), [&inside](){ ++inside; });
+        }
+    });
+
+    size_t refused = 0;
+    std::thread drainer = startDrain(pool, refused);
+    pool.addJob([&outside](){ ++outside; });
+    CHECK(!pool.addJobFor(std::chrono::milliseconds(1), [&outside](){ ++outside; }));
+    for (int i = 0; i < 4; ++i) {
+        pool.addJob(AffinityKey::of(i), [&outside](){ ++outside; });
+    }
+    go = true;
+    drainer.join();
+
+    CHECK(outside == 0);
+    CHECK(inside == 6);
+    CHECK(refused >= 5);    // as well as the jobs startDrain() had refused
+}
+
+
+// Parallel loops whose chunks are cleared from the queue, or refused, fail rather than hang
+void clearedParallelLoopsFail() {
+    {
+        ThreadPool pool(true, 1);
+        Gate gate(pool);
+        std::atomic<bool> broken(false);
+        std::thread caller([&](){
+            try {
+                pool.parallelFor(0, 1000, [](int){ });
+            } catch (const std::future_error& e) {
+                broken = (e.code() == std::future_errc::broken_promise);
+            }
+        });
+        while (pool.queuedJobs() == 0) {
+            std::this_thread::yield();
+        }
+        CHECK(pool.clearQueue() == 1);
+        caller.join();
+        CHECK(broken);
+    }
+    {
+        ThreadPool pool(true, 1);
+        Gate gate(pool);
+        size_t refused = 0;
+        std::thread drainer = startDrain(pool, refused);
+        bool threw = false;
+        try {
+            pool.parallelReduce(0, 100, 0, [](int i){ return i; }, [](int a, int b){ return a + b; });
+        } catch (const std::future_error&) {
+            threw = true;
+        }
+        gate.open();
+        drainer.join();
+        CHECK(threw);
+    }
+    {
+        ThreadPool pool(true, 4);
+        long sum = pool.parallelReduce(0L, 100000L, 0L, [](long i){ return i; }, [](long a, long b){ return a + b; }, 8);
+        CHECK(sum == 4999950000L);
+    }
+}
+
+
+// Callables and submit() results aligned beyond std::max_align_t get memory aligned for them
+struct alignas(128) OverAligned {
+    unsigned char bytes[128];
+};
+
+
+struct alignas(256) OverAlignedResult {
+    int value;
+};
+
+
+void overAlignedCallablesAndResults() {
+    ThreadPool pool(true, 2);
+    std::atomic<int> misaligned(0);
+    std::atomic<int> ran(0);
+    for (int i = 0; i < 200; ++i) {
+        OverAligned capture = {};
+        pool.addJob([capture, &misaligned, &ran](){
+            if ((opaqueAddress(&capture) % alignof(OverAligned)) != 0) {
+                ++misaligned;
+            }
+            ++ran;
+        });
+    }
+
+    std::vector<std::future<OverAlignedResult>> futures;
+    for (int i = 0; i < 200; ++i) {
+        futures.push_back(pool.submit([i](){
+            OverAlignedResult result;
+            result.value = i;
+            return result;
+        }));
+    }
+    int total = 0;
+    for (auto& future : futures) {
+        total += future.get().value;
+    }
+    pool.wait();
+
+    CHECK(ran == 200);
+    CHECK(misaligned == 0);
+    CHECK(total == 199 * 100);
+}
+
+
+// submit() of callables returning references gets futures of references
+int g_referenced = 0;
+
+int& referenced() {
+    return g_referenced;
+}
+
+
+void submitReturningReference() {
+    ThreadPool pool(true, 2);
+    std::future<int&> future = pool.submit(referenced);
+    CHECK(&future.get() == &g_referenced);
+
+    std::string text("text");
+    std::future<const std::string&> text_future = pool.submit([&text]() -> const std::string& { return text; });
+    CHECK(&text_future.get() == &text);
+}
+
+
+// Containers of callables are copied from when passed as lvalues, and containers of Jobs are moved from
+void addJobsFromContainers() {
+    ThreadPool pool(true, 2);
+    std::atomic<int> ran(0);
+    std::list<std::function<void()>> callables(5, [&ran](){ ++ran; });
+    pool.addJobs(callables);
+    std::vector<Job> jobs;
+    for (int i = 0; i < 5; ++i) {
+        jobs.emplace_back([&ran](){ ++ran; });
+    }
+    pool.addJobs(std::move(jobs));
+    pool.wait();
+    CHECK(ran == 10);
+    CHECK(callables.size() == 5);
+}
+
+
+// A queue policy that throws is rethrown to whoever added the job, with the job no longer counted as pending
+void throwingQueuePolicy() {
+    BasicThreadPool<ThrowingQueue> pool(true, 1);
+    std::atomic<int> ran(0);
+    g_throw_on_push = true;
+    bool threw = false;
+    try {
+        pool.addJob([&ran](){ ++ran; });
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+    pool.addJob([&ran](){ ++ran; });
+    pool.wait();    // returns, as the job that wasn't pushed isn't pending
+    CHECK(ran == 1);
+    CHECK(pool.pendingJobs() == 0);
+}
+
+
+// Workers count completed jobs in batches, but the pool is seen to fall idle whatever the number of jobs
+void pendingJobsSettle() {
+    for (int work_stealing = 0; work_stealing < 2; ++work_stealing) {
+        ThreadPool pool(true, 3, work_stealing != 0);
+        std::atomic<int> ran(0);
+        int added = 0;
+        for (int round = 0; round < 100; ++round) {
+            int jobs = 1 + ((round % 7) * 13);
+            for (int i = 0; i < jobs; ++i) {
+                pool.addJob([&ran](){ ++ran; });
+            }
+            added += jobs;
+            pool.wait();
+            CHECK(pool.pendingJobs() == 0);
+        }
+        CHECK(ran == added);
+        pool.resize(1);
+        for (int i = 0; i < 5; ++i) {
+            pool.addJob([&ran](){ ++ran; });
+        }
+        CHECK(pool.drain() == 0);
+        CHECK(ran == added + 5);
+        CHECK(pool.pendingJobs() == 0);
+    }
+}
+
+
+// Jobs too large to be stored inline, added by threads that come and go
+void largeJobsFromShortLivedThreads() {
+    ThreadPool pool(true, 2);
+    std::atomic<int> ran(0);
+    for (int i = 0; i < 200; ++i) {
+        std::thread producer([&pool, &ran](){
+            unsigned char padding[200] = {};
+            pool.addJob([padding, &ran](){ ran += 1 + padding[0]; });
+        });
+        producer.join();
+    }
+    pool.wait();
+    CHECK(ran == 200);
+}
+
+
+#ifdef __cpp_impl_coroutine
+
+// Counts live coroutine frames, so that leaks and double frees show up without a sanitizer
+struct FrameCounter {
+    static std::atomic<int> live;
+
+    FrameCounter() {
+        ++live;
+    }
+
+    ~FrameCounter() {
+        --live;
+    }
+};
+
+std::atomic<int> FrameCounter::live(0);
+
+
+// A coroutine type owned (and destroyed) by its caller, rather than by the pool
+struct CallerOwned {
+    struct promise_type {
+        CallerOwned get_return_object() {
+            return CallerOwned{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_always final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() { }
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+
+    ~CallerOwned() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+
+template<typename Pool>
+Task<int> scheduledValue(Pool& pool, int value) {
+    FrameCounter counter;
+    co_await pool.schedule();
+    co_return value;
+}
+
+
+template<typename Pool>
+Task<int> scheduledSum(Pool& pool, int value) {
+    FrameCounter counter;
+    int first = co_await scheduledValue(pool, value);
+    co_await pool.schedule();
+    int second = co_await scheduledValue(pool, 1);
+    co_return first + second;
+}
+
+
+template<typename Pool>
+CallerOwned scheduledDirectly(Pool& pool) {
+    FrameCounter counter;
+    co_await pool.schedule();
+}
+
+
+template<typename Pool>
+CallerOwned scheduledThroughTask(Pool& pool) {
+    FrameCounter counter;
+    co_await scheduledValue(pool, 0);
+}
+
+
+// Coroutines whose resume job is cleared are destroyed if spawn() started them, and left to their owners otherwise
+void clearedCoroutines() {
+    {
+        ThreadPool pool(true, 1);
+        Gate gate(pool);
+        std::future<int> spawned = pool.spawn(scheduledSum(pool, 1));
+        {
+            CallerOwned direct = scheduledDirectly(pool);
+            CallerOwned through_task = scheduledThroughTask(pool);
+            CHECK(pool.clearQueue() == 3);
+            CHECK(!direct.handle.done());
+            CHECK(!through_task.handle.done());
+        }
+        gate.open();
+        pool.wait();
+        bool broken = false;
+        try {
+            spawned.get();
+        } catch (const std::future_error& e) {
+            broken = (e.code() == std::future_errc::broken_promise);
+        }
+        CHECK(broken);
+    }
+    CHECK(FrameCounter::live == 0);
+
+    {
+        ThreadPool pool(true, 1);
+        std::future<int> spawned;
+        {
+            Gate gate(pool);
+            size_t refused = 0;
+            std::thread drainer = startDrain(pool, refused);
+            spawned = pool.spawn(scheduledSum(pool, 1));
+            gate.open();
+            drainer.join();
+        }
+        bool broken = false;
+        try {
+            spawned.get();
+        } catch (const std::future_error&) {
+            broken = true;
+        }
+        CHECK(broken);
+    }
+    CHECK(FrameCounter::live == 0);
+}
+
+
+// A pool destroyed while an exception unwinds the stack still frees the coroutines it spawned
+void spawnDuringUnwinding() {
+    std::future<int> spawned;
+    try {
+        ThreadPool pool(true, 1);
+        Gate gate(pool);
+        spawned = pool.spawn(scheduledSum(pool, 1));
+        throw std::runtime_error("unwinding");
+    } catch (const std::runtime_error&) { }
+
+    CHECK(spawned.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+    bool broken = false;
+    try {
+        spawned.get();
+    } catch (const std::future_error& e) {
+        broken = (e.code() == std::future_errc::broken_promise);
+    }
+    CHECK(broken);
+    CHECK(FrameCounter::live == 0);
+}
+
+
+// A queue policy that throws while a coroutine's resume job is pushed rethrows into the coroutine from co_await
+void scheduleOnThrowingQueue() {
+    BasicThreadPool<ThrowingQueue> pool(true, 1);
+    bool caught = false;
+    auto body = [&caught](BasicThreadPool<ThrowingQueue>& pool) -> CallerOwned {
+        FrameCounter counter;
+        try {
+            co_await pool.schedule();
+        } catch (const std::runtime_error&) {
+            caught = true;
+        }
+    };
+    g_throw_on_push = true;
+    {
+        CallerOwned coroutine = body(pool);
+        CHECK(caught);
+        CHECK(coroutine.handle.done());
+    }
+    CHECK(FrameCounter::live == 0);
+    CHECK(pool.spawn(scheduledSum(pool, 1)).get() == 2);
+}
+
+
+// Coroutines scheduling themselves from the workers onto a bounded queue that is full most of the time
+void scheduleOnFullBoundedQueue() {
+    using Pool = BasicThreadPool<BoundedMpmcQueue<2>>;
+    for (int work_stealing = 0; work_stealing < 2; ++work_stealing) {
+        Pool pool(true, 3, work_stealing != 0);
+        std::vector<std::future<int>> futures;
+        for (int i = 0; i < 300; ++i) {
+            futures.push_back(pool.spawn(scheduledSum(pool, i)));
+        }
+        long total = 0;
+        for (auto& future : futures) {
+            total += future.get();
+        }
+        CHECK(total == (299 * 300 / 2) + 300);
+    }
+    CHECK(FrameCounter::live == 0);
+}
+
+#endif
+
+
+struct Test {
+    const char* name;
+    void (*run)();
+};
+
+
+const Test TESTS[] = {
+    {"jobsAddingJobsUnbounded", jobsAddingJobsUnbounded},
+    {"jobsAddingJobsBoundedMpmc", jobsAddingJobsBoundedMpmc},
+    {"batchedJobsDontWaitOnEachOther", batchedJobsDontWaitOnEachOther},
+    {"clearQueueDiscardsQueuedJobs", clearQueueDiscardsQueuedJobs},
+    {"tryAddJobOnFullQueue", tryAddJobOnFullQueue},
+    {"drainRefusesExternalJobs", drainRefusesExternalJobs},
+    {"clearedParallelLoopsFail", clearedParallelLoopsFail},
+    {"overAlignedCallablesAndResults", overAlignedCallablesAndResults},
+    {"submitReturningReference", submitReturningReference},
+    {"addJobsFromContainers", addJobsFromContainers},
+    {"throwingQueuePolicy", throwingQueuePolicy},
+    {"pendingJobsSettle", pendingJobsSettle},
+    {"largeJobsFromShortLivedThreads", largeJobsFromShortLivedThreads},
+#ifdef __cpp_impl_coroutine
+    {"clearedCoroutines", clearedCoroutines},
+    {"spawnDuringUnwinding", spawnDuringUnwinding},
+    {"scheduleOnThrowingQueue", scheduleOnThrowingQueue},
+    {"scheduleOnFullBoundedQueue", scheduleOnFullBoundedQueue},
+#endif
+};
+
+
+// Run a test, ending the run if it doesn't finish in time
+bool runTest(const Test& test) {
+    std::mutex mutex;
+    std::condition_variable finished_cv;
+    bool finished = false;
+    std::thread watchdog([&](){
+        std::unique_lock<std::mutex> lk(mutex);
+        if (!finished_cv.wait_for(lk, TEST_TIMEOUT, [&finished](){ return finished; })) {
+            std::cerr << test.name << ": timed out, deadlocked?" << std::endl;
+            std::_Exit(EXIT_FAILURE);
+        }
+    });
+
+    g_failed_checks = 0;
+    test.run();
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        finished = true;
+    }
+    finished_cv.notify_one();
+    watchdog.join();
+
+    std::cout << ((g_failed_checks == 0) ? "passed " : "FAILED ") << test.name << std::endl;
+    return (g_failed_checks == 0);
+}
+
+
+int main(int argc, char** argv) {
+    int failed_tests = 0;
+    int run_tests = 0;
+    for (const Test& test : TESTS) {
+        bool selected = (argc <= 1);
+        for (int i = 1; i < argc; ++i) {
+            selected = selected || (std::strcmp(argv[i], test.name) == 0);
+        }
+        if (selected) {
+            ++run_tests;
+            failed_tests += runTest(test) ? 0 : 1;
+        }
+    }
+    std::cout << (run_tests - failed_tests) << " of " << run_tests << " tests passed" << std::endl;
+    return failed_tests;
+}